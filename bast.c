@@ -13,6 +13,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <time.h>
 
 #include "tokens.h"
 #include "version.h"
@@ -24,6 +25,12 @@
  There is NO WARRANTY, to the extent permitted by law.\n\
  Compiler was %s\n", "bast", VERSION_MAJ, VERSION_MIN, VERSION_REV, VERSION_TXT[0]?"-":"", VERSION_TXT, CC_VERSION
 
+#define LOADER_TABLE	29 // offset of the block table in the headerless loader
+#define FULL_TABLE		117 // offset of the block table in the headerless loader with paging and depacker
+
+#define BASMAX	(0xFF57-0x5CCB) // RAM between PROG and the default RAMTOP on a 48K Spectrum
+#define MERGELEN	255 // longest line -O merge-lines makes (not counting the line number, length and ENTER), so that it can still be edited
+
 #define max(a,b)	((a)>(b)?(a):(b))
 #define min(a,b)	((a)>(b)?(b):(a))
 
@@ -51,9 +58,28 @@ typedef struct
 	int nbytes;
 	bin_byte *bytes;
 	int org;
+	int bank; // 128K RAM bank (0-7) to page in at 0xC000 before loading, or -1
+	unsigned char *packed; // compressed form of the data (--compress), or NULL
+	int plen; // length of packed data
+	int porg; // address to load packed data at (it is then depacked to org)
 }
 bin_seg;
 
+typedef struct
+{
+	int bank; // as bin_seg.bank
+	char name[13]; // filename to LOAD, for DISK output
+}
+ldblock;
+
+typedef struct // what a !load loads, in token.data2
+{
+	int nblocks;
+	ldblock *blocks;
+	bin_seg *mc; // headerless loader, or NULL
+}
+loadinfo;
+
 typedef struct
 {
 	int nlines;
@@ -66,7 +92,14 @@ typedef struct
 	int rnoffset;
 	int rnend;
 	char *block; // data block
-	ssize_t blen; // length of block
+	int blen; // length of block
+	char *vars; // #vars: initial variables area, saved after the program
+	int vlen; // length of vars
+	int base; // address of the first line (0x5CCB, or after the resident part for an overlay)
+	int ovstart; // #pragma overlay: index of the directive line (lines after it are split into overlays), or -1
+	int ovsize; // maximum size of each overlay
+	int ovparent; // for an overlay, the segment holding the resident part; else -1
+	int fbas; // index in inbas of the file it came from, for tokenise()'s messages
 }
 bas_seg;
 
@@ -78,6 +111,28 @@ typedef struct
 }
 segment;
 
+typedef struct
+{
+	FILE *fp;
+	bool wav; // writing audio, rather than .TAP
+	int rate; // sample rate
+	double speed; // speed-up factor (for custom loaders; the ROM won't cope with much more than 1)
+	double t; // time so far, in T-states
+	unsigned long samples; // samples written so far
+	bool level;
+}
+tapeout;
+
+typedef struct
+{
+	char name[13]; // 8.3 filename
+	unsigned char type; // +3 BASIC header: 0=PROGRAM, 3=CODE
+	int param1, param2;
+	int len;
+	unsigned char *data;
+}
+dskfile;
+
 typedef struct
 {
 	int seg; // segment
@@ -88,6 +143,107 @@ typedef struct
 }
 label;
 
+typedef struct astnode astnode;
+
+typedef struct // one part of an AST node, in source order: one of the node's own tokens, or (if node isn't NULL) a child node
+{
+	token tok;
+	astnode *node;
+}
+astitem;
+
+struct astnode // parsed form of a tokenised line.  Serialising the items in order gives back the line's tokens exactly
+{
+	enum {AST_BLOCK, AST_STMT, AST_NUM, AST_STR, AST_VAR, AST_LABEL, AST_FUNC, AST_FN, AST_UNOP, AST_BINOP, AST_PAREN, AST_INDEX} type;
+	unsigned char op; // statement keyword (0 if none), function, or operator; the token, for leaves
+	bool str; // is a string-valued expression
+	int size; // encoded size in bytes, as buildbas() would write it
+	int nitems;
+	astitem *items;
+};
+
+typedef struct
+{
+	token *tok;
+	int ntok;
+	int i; // next token
+}
+astparser;
+
+typedef struct // a literal value, for -O pool-constants
+{
+	char zx[5]; // ZX float
+	int uses;
+	int bytes; // total size of its uses
+	char name; // variable it is pooled in, or 0
+}
+poolval;
+
+typedef struct // a line of a BASIC segment, for -O dead-lines
+{
+	int seg;
+	int line; // index into basic[]
+}
+lineref;
+
+typedef struct // a labelled run of lines, for -O layout
+{
+	int start, end; // basic[] indices: the label line, and one past the last line
+	int nreal; // real lines in it
+	double weight; // executions of its lines, from the profile
+	bool data; // has DATA, so keeps its order among the others that do
+	bool falls; // control can run off its end into the next block
+}
+lblock;
+
+typedef struct // one step of a peephole pattern (or replacement)
+{
+	enum {PK_TOK, PK_EXPR, PK_NUM, PK_NEXT, PK_EOL} kind;
+	token tok; // PK_TOK: the token itself
+	int slot; // PK_EXPR, PK_NUM: which wildcard; a second use must match the same tokens
+	int rbp; // PK_EXPR: priority of the operator after it in the pattern, so that eg. '{e1}+0' stops before the '+'
+	int next; // the trie node it leads to
+}
+pedge;
+
+typedef struct // a node of the trie the peephole patterns are compiled into
+{
+	int nedges;
+	pedge *edges;
+	int rule; // the rule whose pattern ends here, or -1
+}
+pnode;
+
+typedef struct // a peephole rule
+{
+	char *text; // as written
+	int nrep;
+	pedge *rep; // its replacement
+	int uses;
+}
+prule;
+
+typedef struct // a long variable name, for -O short-vars
+{
+	char *name; // lower case
+	int uses;
+	char to[3]; // its new name, or ""
+	bool keep; // named where we can't rename it (#vars, VAL "...")
+}
+varname;
+
+typedef struct
+{
+	const char *name; // as given to -O
+	int (*run)(int *nsegs, segment **data, char **inbas); // returns nonzero on error
+	unsigned char levels; // which of -O1, -O2, -Os turn it on
+}
+optpass;
+
+#define OLEVEL_1	1
+#define OLEVEL_2	2
+#define OLEVEL_S	4
+
 #define LOC		"%s:%u"
 #define LOCARG	inbas[fbas], fline
 
@@ -99,15 +255,137 @@ void append_char(char **buf, int *l, int *i, char c);
 void append_str(char **buf, int *l, int *i, char *str);
 int addinbas(int *ninbas, char ***inbas, char *arg);
 int addbasline(int *nlines, basline **basic, char *line);
+int renumstep(bas_seg *bas);
 segment *addsegment(int *nsegs, segment **data);
+segment *dupsegs(segment *data, int nsegs);
 void basfree(basline b);
 void tokenise(basline *b, char **inbas, int fbas, int renum);
 token gettoken(char *data, int *bt);
 void zxfloat(char *buf, double value);
+double zxvalue(const char *buf);
+bool zxfits(double value);
+double zxround(double value);
+double zxdecfp(const char *text);
+bool zxreads(const char *text, double value, const char *as);
+void zxtext(char *text, double value);
+bool zxshort(char *text, double value, const char *as);
+token mknum(double value);
+token mktok(unsigned char tok);
 bool isvalidlabel(char *text);
+int toksize(const token *t);
+int esclen(const char *p);
+const char *tokname(unsigned char tok);
+astnode *ast_new(int type, unsigned char op);
+void ast_tok(astnode *n, token t);
+void ast_add(astnode *n, astnode *child);
+bool ast_at(astparser *p, unsigned char tok);
+int ast_binprio(unsigned char tok);
+void ast_args(astparser *p, astnode *n);
+astnode *ast_postfix(astparser *p, astnode *n);
+astnode *ast_operand(astparser *p);
+astnode *ast_expr(astparser *p, int rbp);
+astnode *ast_stmt(astparser *p);
+astnode *ast_block(astparser *p);
+astnode *ast_parse(basline *b);
+int ast_size(astnode *n);
+void ast_unparse(astnode *n, int *ntok, token **tok);
+void ast_toline(astnode *n, basline *b);
+void ast_free(astnode *n);
+void ast_dump(FILE *fp, astnode *n);
+int ast_prio(astnode *n);
+astnode *ast_paren(astnode *n);
+astnode *ast_wrap(astnode *parent, int i, astnode *child);
+astnode *ast_binop(astnode *lhs, unsigned char op, astnode *rhs);
+astnode *ast_copyvar(astnode *n);
 void addlabel(int *nlabels, label **labels, label lbl);
 void buildbas(bas_seg *bas, bool write);
+int addvar(bas_seg *bas, char *decl);
+int mkoverlays(int *nsegs, segment **data, int seg, char **inbas);
 void bin_load(char *fname, FILE *fp, bin_seg * buf, char **name);
+loadinfo *mkloader(segment *data, int nsegs, int seg, bool disk, bool headerless);
+void append_num(char **buf, int *l, int *i, unsigned int value, int width);
+int pack(const unsigned char *src, int len, unsigned char **dst, int *margin);
+int unpack(const unsigned char *src, int len, unsigned char *dst, int max);
+int mksysvars(unsigned char *mem, bas_seg *bas, int ramtop);
+void dskname(char *buf, const char *name, bool code);
+void tape_block(tapeout *tape, const unsigned char *buf, int len);
+void wav_start(tapeout *tape);
+void wav_pulse(tapeout *tape, int tstates);
+void wav_finish(tapeout *tape);
+int writedsk(FILE *fp, dskfile *files, int nfiles);
+int bassize(segment *data, int nsegs);
+int opt_cutnumbers(int *nsegs, segment **data, char **inbas);
+int opt_constarith(int *nsegs, segment **data, char **inbas);
+int opt_strength(int *nsegs, segment **data, char **inbas);
+bool ast_whole(astnode *n);
+int ast_reduce(astnode *n, const char *seg, int sline);
+int opt_smalllit(int *nsegs, segment **data, char **inbas);
+int opt_shortnum(int *nsegs, segment **data, char **inbas);
+astnode *ast_func(unsigned char func, astnode *arg);
+int opt_pool(int *nsegs, segment **data, char **inbas);
+int opt_shortvars(int *nsegs, segment **data, char **inbas);
+int opt_deadlines(int *nsegs, segment **data, char **inbas);
+int opt_merge(int *nsegs, segment **data, char **inbas);
+int opt_striprem(int *nsegs, segment **data, char **inbas);
+int opt_layout(int *nsegs, segment **data, char **inbas);
+int opt_peephole(int *nsegs, segment **data, char **inbas);
+int opt_packdata(int *nsegs, segment **data, char **inbas);
+int opt_packbeeps(int *nsegs, segment **data, char **inbas);
+int pb_note(basline *b, int k, int e, unsigned char *note);
+int opt_packdraw(int *nsegs, segment **data, char **inbas);
+bool pv_arg(basline *b, int *k, int e, int *value);
+int pv_item(basline *b, int k, int e, unsigned char *out);
+int pk_runs(segment *seg, const char *pass, const char *lbl, int (*item)(basline *, int, int, unsigned char *), const unsigned char *end, int elen, const unsigned char *player, int plen, int *nitems, int *nruns, int *nlines);
+int pd_end(basline *b, int k);
+void pd_add(token **nt, int *nn, token t);
+void pd_restore(token **nt, int *nn, token ref, int ptr, int off);
+int pp_parse(char *text, pedge **out, char *where);
+int pp_add(pnode **trie, int *nnodes, pedge *pat, int npat, int rule);
+int pp_rule(pnode **trie, int *nnodes, prule **rules, int *nrules, char *text, char *where);
+bool pp_same(const token *a, const token *b);
+bool pp_next(bas_seg *bas, int j, const token *t);
+int pp_match(pnode *trie, int node, bas_seg *bas, int j, int pos, int *bs, int *be, int *end);
+int lb_cmp(const void *a, const void *b);
+bool *ml_targets(bas_seg *bas);
+int ml_size(basline *b);
+bool ml_ends(basline *b);
+int ml_loop(bas_seg *bas, bool *target, int j);
+int dl_first(bas_seg *bas, int j);
+int dl_number(bas_seg *bas, int n);
+bool dl_label(int nsegs, segment *data, const char *name, lineref *at);
+bool dl_walk(astnode *blk, bas_seg *bas, int s, lineref **work, int *nwork, bool *computed);
+void dl_push(lineref **work, int *nwork, int seg, int line);
+int sv_find(varname **vars, int *nvars, const char *name, int len);
+void sv_vals(const char *str, varname **vars, int *nvars);
+int sv_cmp(const void *a, const void *b);
+void pool_count(astnode *n, poolval **vals, int *nvals);
+bool usedletters(bas_seg *bas, bool *used);
+int pool_replace(astnode *n, poolval *vals, int nvals);
+astnode *ast_small(double value, bool bare, int *size);
+int ast_smalllit(astnode *n, int *saved);
+bool ast_const(astnode *n, double *value);
+astnode *ast_num(double value);
+int ast_fold(astnode *n);
+
+optpass passes[]= // the optimiser runs the enabled ones in this order
+{
+	{"cut-numbers", opt_cutnumbers, OLEVEL_S}, // first, so that the other passes see what numbers will cost
+	{"dead-lines", opt_deadlines, OLEVEL_2}, // before the others, so they don't count what it removes
+	{"short-numbers", opt_shortnum, OLEVEL_1}, // early, so that the costs the later passes weigh are the short ones
+	{"peephole", opt_peephole, OLEVEL_2}, // before strip-rem, which tidies away any REMs it leaves
+	{"pack-data", opt_packdata, OLEVEL_S}, // before merge-lines, so that lines it empties aren't merged first
+	{"pack-beeps", opt_packbeeps, OLEVEL_S}, // before merge-lines, which would put other statements after the runs (a run has to end its line)
+	{"pack-draw", opt_packdraw, OLEVEL_S}, // likewise
+	{"strip-rem", opt_striprem, OLEVEL_2}, // before merge-lines, which can't join a line onto one with a REM
+	{"merge-lines", opt_merge, OLEVEL_2},
+	{"constant-arithmetic", opt_constarith, OLEVEL_1},
+	{"strength-reduce", opt_strength, OLEVEL_1},
+	{"short-vars", opt_shortvars, OLEVEL_2}, // before pool-constants, so the busiest variables get first pick of the letters
+	{"pool-constants", opt_pool, OLEVEL_S},
+	{"small-literals", opt_smalllit, OLEVEL_S},
+	{"layout", opt_layout, 0}, // only when asked for, as it needs --profile; last, so its line numbers are the ones the profile saw
+};
+#define NPASSES	(int)(sizeof(passes)/sizeof(*passes))
 
 bool debug=false;
 bool Wobjlen=false;
@@ -115,6 +393,10 @@ bool Wobjsum=true;
 bool Wsebasic=true;
 bool Wembeddednewline=true;
 bool Ocutnumbers=false;
+bool Oshortnumbers=false;
+char *profile=NULL; // --profile: line execution counts for -O layout
+char *rulefile=NULL; // --rules: more rules for -O peephole
+char *Ooutfile=NULL; // the output being built, for passes which write a file alongside it
 
 int main(int argc, char *argv[])
 {
@@ -127,17 +409,32 @@ int main(int argc, char *argv[])
 	char **inbas=NULL;
 	int ninobj=0;
 	char **inobj=NULL;
-	enum {NONE, OBJ, TAPE} outtype=NONE;
-	char *outfile=NULL;
-	bool emu=false;
+	enum {NONE, OBJ, TAPE, SNAPSHOT, DISK, WAV}; // output types
+	typedef struct // an output file, with the options which only affect it
+	{
+		int type;
+		char *file;
+		unsigned long opt; // optimisation passes to run; bit n is passes[n]
+		bool headerless, compress;
+		bool autoboot; // for DISK: add a 'DISK' loader
+		bool emu;
+		int usr; // for SNAPSHOT: start at a USR address instead of the autostart line
+		int wavrate;
+		double wavspeed;
+	}
+	target;
+	target opts={NONE, NULL, 0, false, false, false, false, -1, 44100, 1}; // options given before the first output are defaults for all of them
+	int ntargets=0;
+	target *targets=NULL, *tg=&opts; // options apply to the most recent output
 	int arg;
 	int state=0;
 	for(arg=1;arg<argc;arg++)
 	{
 		char *varg=argv[arg];
-		if(strcmp(varg, "-")==0)
+		bool tostdout=(strcmp(varg, "-")==0)&&(state==11); // -w - streams to stdout
+		if((strcmp(varg, "-")==0)&&!tostdout)
 			varg="/dev/stdin";
-		if(*varg=='-')
+		if((*varg=='-')&&!tostdout)
 		{
 			if(strcmp(varg, "-V")==0)
 			{
@@ -146,11 +443,19 @@ int main(int argc, char *argv[])
 			}
 			else if(strcmp(varg, "--emu")==0)
 			{
-				emu=true;
+				tg->emu=true;
 			}
 			else if(strcmp(varg, "--no-emu")==0)
 			{
-				emu=false;
+				tg->emu=false;
+			}
+			else if(strcmp(varg, "--autoboot")==0)
+			{
+				tg->autoboot=true;
+			}
+			else if(strcmp(varg, "--no-autoboot")==0)
+			{
+				tg->autoboot=false;
 			}
 			else if(strcmp(varg, "--debug")==0)
 			{
@@ -160,12 +465,44 @@ int main(int argc, char *argv[])
 			{
 				debug=false;
 			}
+			else if(strcmp(varg, "--headerless")==0)
+			{
+				tg->headerless=true;
+			}
+			else if(strcmp(varg, "--no-headerless")==0)
+			{
+				tg->headerless=false;
+			}
+			else if(strcmp(varg, "--compress")==0)
+			{
+				tg->compress=true;
+			}
+			else if(strcmp(varg, "--no-compress")==0)
+			{
+				tg->compress=false;
+			}
 			else if(strcmp(varg, "-b")==0)
 				state=1;
 			else if(strcmp(varg, "-l")==0)
 				state=7;
 			else if(strcmp(varg, "-t")==0)
 				state=2;
+			else if(strcmp(varg, "-s")==0)
+				state=8;
+			else if(strcmp(varg, "-d")==0)
+				state=10;
+			else if(strcmp(varg, "-w")==0)
+				state=11;
+			else if(strcmp(varg, "--rate")==0)
+				state=12;
+			else if(strcmp(varg, "--speed")==0)
+				state=13;
+			else if(strcmp(varg, "--usr")==0)
+				state=9;
+			else if(strcmp(varg, "--profile")==0)
+				state=14;
+			else if(strcmp(varg, "--rules")==0)
+				state=15;
 			else if(strcmp(varg, "-W")==0)
 				state=3;
 			else if(strcmp(varg, "-W-")==0)
@@ -174,6 +511,15 @@ int main(int argc, char *argv[])
 				state=5;
 			else if(strcmp(varg, "-O-")==0)
 				state=6;
+			else if((strncmp(varg, "-O", 2)==0)&&varg[2]&&strchr("012s", varg[2])&&!varg[3]) // -O0, -O1, -O2, -Os: replace the set of passes with a preset
+			{
+				unsigned char level=(varg[2]=='0')?0:(varg[2]=='1')?OLEVEL_1:(varg[2]=='2')?OLEVEL_1|OLEVEL_2:OLEVEL_1|OLEVEL_2|OLEVEL_S;
+				int p;
+				tg->opt=0;
+				for(p=0;p<NPASSES;p++)
+					if(passes[p].levels&level)
+						tg->opt|=1UL<<p;
+			}
 			else
 			{
 				fprintf(stderr, "bast: No such option %s\n", varg);
@@ -203,8 +549,48 @@ int main(int argc, char *argv[])
 					state=0;
 				break;
 				case 2:
-					outtype=TAPE;
-					outfile=strdup(varg);
+				case 8:
+				case 10:
+				case 11:
+					targets=(target *)realloc(targets, ++ntargets*sizeof(target));
+					tg=&targets[ntargets-1];
+					*tg=opts;
+					tg->type=(state==2)?TAPE:(state==8)?SNAPSHOT:(state==10)?DISK:WAV;
+					tg->file=strdup(varg);
+					state=0;
+				break;
+				case 12:
+					if((sscanf(varg, "%d", &tg->wavrate)!=1)||(tg->wavrate<8000))
+					{
+						fprintf(stderr, "bast: Bad sample rate %s to --rate\n", varg);
+						return(EXIT_FAILURE);
+					}
+					state=0;
+				break;
+				case 13:
+					if((sscanf(varg, "%lf", &tg->wavspeed)!=1)||(tg->wavspeed<=0))
+					{
+						fprintf(stderr, "bast: Bad factor %s to --speed\n", varg);
+						return(EXIT_FAILURE);
+					}
+					state=0;
+				break;
+				case 14:
+					profile=strdup(varg);
+					state=0;
+				break;
+				case 15:
+					rulefile=strdup(varg);
+					state=0;
+				break;
+				case 9:;
+					char *end;
+					tg->usr=strtol(varg, &end, 0);
+					if(*end||(tg->usr<0)||(tg->usr>0xFFFF))
+					{
+						fprintf(stderr, "bast: Bad address %s to --usr\n", varg);
+						return(EXIT_FAILURE);
+					}
 					state=0;
 				break;
 				case 3:
@@ -238,12 +624,20 @@ int main(int argc, char *argv[])
 				break;
 				case 5:
 					flag=true; // fallthrough
-				case 6:
-					if(strcmp("cut-numbers", varg)==0)
+				case 6:;
+					int p;
+					for(p=0;p<NPASSES;p++)
+						if(strcmp(passes[p].name, varg)==0) break;
+					if(p==NPASSES)
 					{
-						Ocutnumbers=flag;
-						state=0;
+						fprintf(stderr, "bast: No such optimisation %s\n", varg);
+						return(EXIT_FAILURE);
 					}
+					if(flag)
+						tg->opt|=1UL<<p;
+					else
+						tg->opt&=~(1UL<<p);
+					state=0;
 				break;
 				default:
 					fprintf(stderr, "bast: Internal error: Bad state %u in args\n", state);
@@ -261,7 +655,7 @@ int main(int argc, char *argv[])
 		return(EXIT_FAILURE);
 	}
 	
-	if((outtype==NONE)||!outfile)
+	if(!ntargets)
 	{
 		fprintf(stderr, "bast: No output file specified\n");
 		return(EXIT_FAILURE);
@@ -295,7 +689,7 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "bast: Internal error: failed to add segment for file %s\n", inbas[fbas]);
 			return(EXIT_FAILURE);
 		}
-		curr->name=(char *)malloc(10);
+		curr->name=(char *)malloc(14);
 		sprintf(curr->name, "bas%u", fbas);
 		curr->type=BASIC;
 		curr->data.bas.nlines=0;
@@ -304,6 +698,12 @@ int main(int argc, char *argv[])
 		curr->data.bas.lline=NULL;
 		curr->data.bas.renum=0;
 		curr->data.bas.block=NULL;
+		curr->data.bas.vars=NULL;
+		curr->data.bas.vlen=0;
+		curr->data.bas.base=0x5CCB;
+		curr->data.bas.ovstart=-1;
+		curr->data.bas.ovparent=-1;
+		curr->data.bas.fbas=fbas;
 		while(!feof(fp))
 		{
 			char *line=fgetl(fp);
@@ -414,6 +814,22 @@ int main(int argc, char *argv[])
 											arg=strtok(NULL, " ");
 										}
 									}
+									else if(strcmp(prgm, "overlay")==0)
+									{
+										if(curr->data.bas.ovstart>=0)
+										{
+											fprintf(stderr, "bast: Only one #pragma overlay is allowed per BASIC segment\n\t"LOC"\n", LOCARG);
+											return(EXIT_FAILURE);
+										}
+										curr->data.bas.ovstart=curr->data.bas.nlines-1;
+										curr->data.bas.ovsize=16384;
+										char *size=strtok(NULL, "");
+										if(size&&((sscanf(size, "%d", &curr->data.bas.ovsize)!=1)||(curr->data.bas.ovsize<=0)))
+										{
+											fprintf(stderr, "bast: #pragma overlay bad size %s\n\t"LOC"\n", size, LOCARG);
+											return(EXIT_FAILURE);
+										}
+									}
 									else
 									{
 										fprintf(stderr, "bast: Warning: #pragma %s not recognised (ignoring)\n\t"LOC"\n", prgm, LOCARG);
@@ -425,6 +841,15 @@ int main(int argc, char *argv[])
 									return(EXIT_FAILURE);
 								}
 							}
+							else if(strcmp(cmd, "#vars")==0)
+							{
+								char *decl=strtok(NULL, "");
+								if(!decl||addvar(&curr->data.bas, decl))
+								{
+									fprintf(stderr, "bast: Bad #vars declaration\n\t"LOC"\n", LOCARG);
+									return(EXIT_FAILURE);
+								}
+							}
 							else if(strcmp(cmd, "##")==0)
 							{
 								// comment, ignore
@@ -461,7 +886,7 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "bast: Internal error: failed to add segment for file %s\n", inobj[fobj]);
 			return(EXIT_FAILURE);
 		}
-		curr->name=(char *)malloc(10);
+		curr->name=(char *)malloc(14);
 		sprintf(curr->name, "bin%u", fobj);
 		curr->type=BINARY;
 		err=false;
@@ -474,6 +899,47 @@ int main(int argc, char *argv[])
 	}
 	/* END: READ OBJECT FILES */
 	
+	/* CHECK MEMORY LAYOUT */
+	{
+		int i,j;
+		for(i=0;i<nsegs;i++)
+		{
+			if(data[i].type!=BINARY) continue;
+			bin_seg *a=&data[i].data.bin;
+			if(a->bank>=0)
+			{
+				if(a->bank>7)
+				{
+					fprintf(stderr, "bast: CODE segment %s has bad bank %d (must be 0-7)\n", data[i].name, a->bank);
+					return(EXIT_FAILURE);
+				}
+				if((a->org<0xC000)||(a->org+a->nbytes>0x10000))
+				{
+					fprintf(stderr, "bast: Banked CODE segment %s (0x%04X, %u bytes) must lie within 0xC000-0xFFFF\n", data[i].name, a->org, a->nbytes);
+					return(EXIT_FAILURE);
+				}
+			}
+			if(a->org<0) continue;
+			if(a->org+a->nbytes>0x10000)
+			{
+				fprintf(stderr, "bast: CODE segment %s (0x%04X, %u bytes) runs past the top of memory\n", data[i].name, a->org, a->nbytes);
+				return(EXIT_FAILURE);
+			}
+			for(j=0;j<i;j++) // banked segments only ever overlap within 0xC000-0xFFFF, where the unbanked memory is bank 0
+			{
+				if(data[j].type!=BINARY) continue;
+				bin_seg *b=&data[j].data.bin;
+				if((b->org<0)||(max(a->bank, 0)!=max(b->bank, 0))) continue;
+				if((a->org<b->org+b->nbytes)&&(b->org<a->org+a->nbytes))
+				{
+					fprintf(stderr, "bast: CODE segments %s and %s overlap (in bank %d)\n", data[j].name, data[i].name, max(a->bank, 0));
+					return(EXIT_FAILURE);
+				}
+			}
+		}
+	}
+	/* END: CHECK MEMORY LAYOUT */
+	
 	/* TODO: fork the assembler for each #[r]asm/#endasm block */
 	
 	/* TOKENISE BASIC SEGMENTS */
@@ -491,440 +957,903 @@ int main(int argc, char *argv[])
 				{
 					err=false;
 					if(debug) fprintf(stderr, "bast: tokenising line %s\n", data[i].data.bas.basic[j].text);
-					tokenise(&data[i].data.bas.basic[j], inbas, i, data[i].data.bas.renum);
+					tokenise(&data[i].data.bas.basic[j], inbas, data[i].data.bas.fbas, data[i].data.bas.renum);
 					if(data[i].data.bas.basic[j].ntok) data[i].data.bas.blines++;
 					if(err) return(EXIT_FAILURE);
 				}
 				fprintf(stderr, "bast: Tokenised BASIC segment %s (%u logical lines)\n", data[i].name, data[i].data.bas.blines);
+				if(debug) // check that the parser gives back each line's exact tokens, and sizes agreeing with buildbas()
+				{
+					bas_seg *bas=&data[i].data.bas;
+					bas->blen=0;
+					buildbas(bas, false);
+					for(j=0;j<bas->nlines;j++)
+					{
+						astnode *ast=ast_parse(&bas->basic[j]);
+						if(!ast) continue;
+						fprintf(stderr, "bast: AST: ");
+						ast_dump(stderr, ast);
+						fputc('\n', stderr);
+						int ntok=0, k;
+						token *tok=NULL;
+						ast_unparse(ast, &ntok, &tok);
+						bool same=(ntok==bas->basic[j].ntok);
+						for(k=0;same&&(k<ntok);k++)
+							same=(tok[k].tok==bas->basic[j].tok[k].tok)&&(tok[k].data==bas->basic[j].tok[k].data);
+						int len=((j+1<bas->nlines)?bas->basic[j+1].offset:bas->blen+4+bas->base)-bas->basic[j].offset-5; // less the header and the 0x0D
+						if(!same||(ast->size!=len))
+						{
+							fprintf(stderr, "bast: Internal error: AST of line doesn't match its tokens (%u tokens -> %u, %u bytes -> %u)\n\t%s:%u\n", bas->basic[j].ntok, ntok, len, ast->size, data[i].name, bas->basic[j].sline);
+							return(EXIT_FAILURE);
+						}
+						free(tok);
+						ast_free(ast);
+					}
+				}
 			}
 		}
 	}
 	/* END: TOKENISE BASIC SEGMENTS */
 	
-	/* LINKER & LABELS */
-	// PASS 1: Find labels, renumber labelled BASIC sources, load in !links as attached bin_segs
-	int nlabels=0;
-	label * labels=NULL;
-	int i;
-	for(i=0;i<nsegs;i++)
+	/* SPLIT OVERLAYS */
 	{
-		fprintf(stderr, "bast: Linker (Pass 1): %s\n", data[i].name);
-		switch(data[i].type)
+		int i;
+		for(i=0;i<nsegs;i++)
 		{
-			case BASIC:;
-				int num=0,dnum=0;
-				if(data[i].data.bas.renum==1)
+			if((data[i].type==BASIC)&&(data[i].data.bas.ovstart>=0))
+			{
+				if(mkoverlays(&nsegs, &data, i, inbas))
+				{
+					fprintf(stderr, "bast: Failed to split BASIC segment %s into overlays\n", data[i].name);
+					return(EXIT_FAILURE);
+				}
+			}
+		}
+	}
+	/* END: SPLIT OVERLAYS */
+	
+	/* BUILD EACH TARGET */
+	segment *front=data; // the front end's segments; each target links its own copy
+	int nfront=nsegs;
+	int t;
+	for(t=0;t<ntargets;t++)
+	{
+		tg=&targets[t];
+		if(tg->compress)
+			tg->headerless=true; // packed blocks can only be loaded (and depacked) by the !load loader
+		Ocutnumbers=false; // unless the cut-numbers pass turns it on
+		Oshortnumbers=false;
+		Ooutfile=tg->file;
+		if(ntargets>1)
+			fprintf(stderr, "bast: Building target %s\n", tg->file);
+		nsegs=nfront;
+		data=(t<ntargets-1)?dupsegs(front, nfront):front; // the last target can have the originals
+		
+		/* OPTIMISE */
+		{
+			int p;
+			for(p=0;p<NPASSES;p++)
+			{
+				if(!(tg->opt&(1UL<<p))) continue;
+				int before=bassize(data, nsegs);
+				clock_t start=clock();
+				if(passes[p].run(&nsegs, &data, inbas))
+				{
+					fprintf(stderr, "bast: Optimiser: pass %s failed\n", passes[p].name);
+					return(EXIT_FAILURE);
+				}
+				double ms=(clock()-start)*1000.0/CLOCKS_PER_SEC;
+				int after=bassize(data, nsegs);
+				if((before<0)||(after<0))
+				{
+					fprintf(stderr, "bast: Optimiser: Internal error: failed to measure BASIC after pass %s\n", passes[p].name);
+					return(EXIT_FAILURE);
+				}
+				fprintf(stderr, "bast: Optimiser: %s: %u -> %u bytes (%+d) in %.2fms\n", passes[p].name, before, after, after-before, ms);
+			}
+		}
+		/* END: OPTIMISE */
+		
+		/* COALESCE HEADERLESS BLOCKS */
+		if(tg->headerless)
+		{
+			int i;
+			for(i=0;i<nsegs;i++)
+			{
+				if(data[i].type==BINARY)
 				{
-					dnum=data[i].data.bas.rnoffset?data[i].data.bas.rnoffset:10;
-					int end=data[i].data.bas.rnend?data[i].data.bas.rnend:9999;
-					while(data[i].data.bas.blines*dnum>end)
+					if(data[i].data.bin.org<0)
 					{
-						dnum--;
-						if((dnum==7)||(dnum==9))
-							dnum--;
+						fprintf(stderr, "bast: Headerless CODE segment %s has no ORG\n", data[i].name);
+						return(EXIT_FAILURE);
 					}
-					if(!dnum)
+					while((i+1<nsegs) && (data[i+1].type==BINARY) && (data[i+1].data.bin.org==data[i].data.bin.org+data[i].data.bin.nbytes) && (data[i+1].data.bin.bank==data[i].data.bin.bank) && (data[i].data.bin.nbytes+data[i+1].data.bin.nbytes<=0xFFFF))
 					{
-						fprintf(stderr, "bast: Renumber: Couldn't fit %s into available lines\n", data[i].name);
-						return(EXIT_FAILURE);
+						bin_seg *a=&data[i].data.bin, *b=&data[i+1].data.bin;
+						a->bytes=(bin_byte *)realloc(a->bytes, (a->nbytes+b->nbytes)*sizeof(bin_byte));
+						memcpy(a->bytes+a->nbytes, b->bytes, b->nbytes*sizeof(bin_byte));
+						a->nbytes+=b->nbytes;
+						fprintf(stderr, "bast: Merged CODE segment %s into %s (now %u bytes at 0x%04X)\n", data[i+1].name, data[i].name, a->nbytes, a->org);
+						free(b->bytes);
+						free(data[i+1].name);
+						memmove(data+i+1, data+i+2, (nsegs-i-2)*sizeof(segment));
+						nsegs--;
 					}
-					num=data[i].data.bas.rnstart?data[i].data.bas.rnstart:dnum;
-					fprintf(stderr, "bast: Renumber: BASIC segment %s, start %u, spacing %u, end <=%u\n", data[i].name, num, dnum, end);
 				}
-				int dl;
-				init_char(&data[i].data.bas.block, &dl, (int *)&data[i].data.bas.blen);
-				int last=0;
-				int j;
-				for(j=0;j<data[i].data.bas.nlines;j++)
+			}
+		}
+		/* END: COALESCE HEADERLESS BLOCKS */
+		
+		/* COMPRESS BINARY SEGMENTS */
+		if(tg->compress && ((tg->type==TAPE)||(tg->type==WAV)))
+		{
+			int i;
+			for(i=0;i<nsegs;i++)
+			{
+				if(data[i].type==BINARY)
 				{
-					if(data[i].data.bas.basic[j].ntok)
+					bin_seg *b=&data[i].data.bin;
+					unsigned char *raw=(unsigned char *)malloc(b->nbytes), *packed=NULL;
+					int j;
+					for(j=0;j<b->nbytes;j++)
+						raw[j]=b->bytes[j].byte;
+					int margin;
+					int plen=pack(raw, b->nbytes, &packed, &margin);
+					unsigned char *check=(unsigned char *)malloc(b->nbytes);
+					if((plen<0)||(unpack(packed, plen, check, b->nbytes)!=b->nbytes)||memcmp(raw, check, b->nbytes))
+					{
+						fprintf(stderr, "bast: Internal error: compressed CODE segment %s failed to round-trip; storing it uncompressed\n", data[i].name);
+						free(packed);
+					}
+					else if(plen>=b->nbytes)
+					{
+						fprintf(stderr, "bast: CODE segment %s does not compress (%u -> %u bytes); storing it uncompressed\n", data[i].name, b->nbytes, plen);
+						free(packed);
+					}
+					else if(b->org+b->nbytes+margin>0x10000)
 					{
-						if(num)
+						fprintf(stderr, "bast: Warning: CODE segment %s too near the top of memory to depack in place (margin %u); storing it uncompressed\n", data[i].name, margin);
+						free(packed);
+					}
+					else
+					{
+						b->packed=packed;
+						b->plen=plen;
+						b->porg=b->org+b->nbytes+margin-plen;
+						fprintf(stderr, "bast: Compressed CODE segment %s: %u -> %u bytes (loads at 0x%04X, clobbers %u bytes above 0x%04X)\n", data[i].name, b->nbytes, plen, b->porg, margin, b->org+b->nbytes);
+					}
+					free(check);
+					free(raw);
+				}
+			}
+		}
+		/* END: COMPRESS BINARY SEGMENTS */
+		
+		/* LINKER & LABELS */
+		// PASS 1: Find labels, renumber labelled BASIC sources, load in !links as attached bin_segs
+		int nlabels=0;
+		label * labels=NULL;
+		int i;
+		for(i=0;i<nsegs;i++)
+		{
+			fprintf(stderr, "bast: Linker (Pass 1): %s\n", data[i].name);
+			switch(data[i].type)
+			{
+				case BASIC:;
+					if(data[i].data.bas.ovparent>=0) // overlays are MERGEd in after the resident part
+						data[i].data.bas.base=data[data[i].data.bas.ovparent].data.bas.base+data[data[i].data.bas.ovparent].data.bas.blen;
+					int num=0,dnum=0;
+					if(data[i].data.bas.renum==1)
+					{
+						dnum=renumstep(&data[i].data.bas);
+						int end=data[i].data.bas.rnend?data[i].data.bas.rnend:9999;
+						if(!dnum)
 						{
-							if(data[i].data.bas.renum!=1)
-							{
-								fprintf(stderr, "bast: Linker (Pass 1): Internal error (num!=0 but renum!=1), %s\n", data[i].name);
-								return(EXIT_FAILURE);
-							}
-							data[i].data.bas.basic[j].number=num;
-							num+=dnum;
+							fprintf(stderr, "bast: Renumber: Couldn't fit %s into available lines\n", data[i].name);
+							return(EXIT_FAILURE);
 						}
-						else
+						num=data[i].data.bas.rnstart?data[i].data.bas.rnstart:dnum;
+						fprintf(stderr, "bast: Renumber: BASIC segment %s, start %u, spacing %u, end <=%u\n", data[i].name, num, dnum, end);
+					}
+					int dl;
+					init_char(&data[i].data.bas.block, &dl, &data[i].data.bas.blen);
+					int last=0;
+					int j;
+					for(j=0;j<data[i].data.bas.nlines;j++)
+					{
+						if(data[i].data.bas.basic[j].ntok)
 						{
-							if(data[i].data.bas.renum)
+							if(num)
 							{
-								fprintf(stderr, "bast: Linker (Pass 1): Internal error (num==0 but renum!=0), %s\n", data[i].name);
-								return(EXIT_FAILURE);
+								if(data[i].data.bas.renum!=1)
+								{
+									fprintf(stderr, "bast: Linker (Pass 1): Internal error (num!=0 but renum!=1), %s\n", data[i].name);
+									return(EXIT_FAILURE);
+								}
+								data[i].data.bas.basic[j].number=num;
+								num+=dnum;
 							}
-							while(last<nlabels)
+							else
 							{
-								labels[last].sline=j;
-								labels[last++].line=data[i].data.bas.basic[j].number;
+								if(data[i].data.bas.renum)
+								{
+									fprintf(stderr, "bast: Linker (Pass 1): Internal error (num==0 but renum!=0), %s\n", data[i].name);
+									return(EXIT_FAILURE);
+								}
+								while(last<nlabels)
+								{
+									labels[last].sline=j;
+									labels[last++].line=data[i].data.bas.basic[j].number;
+								}
 							}
-						}
-						int k;
-						for(k=0;k<data[i].data.bas.basic[j].ntok;k++)
-						{
-							if(data[i].data.bas.basic[j].tok[k].tok==TOKEN_RLINK)
+							int k;
+							for(k=0;k<data[i].data.bas.basic[j].ntok;k++)
 							{
-								if(data[i].data.bas.basic[j].tok[k].data)
+								if(data[i].data.bas.basic[j].tok[k].tok==TOKEN_RLINK)
 								{
-									FILE *fp=fopen(data[i].data.bas.basic[j].tok[k].data, "rb");
-									if(fp)
+									if(data[i].data.bas.basic[j].tok[k].data)
 									{
-										data[i].data.bas.basic[j].tok[k].data2=(char *)malloc(sizeof(bin_seg));
-										err=false;
-										bin_load(data[i].data.bas.basic[j].tok[k].data, fp, (bin_seg *)data[i].data.bas.basic[j].tok[k].data2, NULL);
-										if(err)
+										FILE *fp=fopen(data[i].data.bas.basic[j].tok[k].data, "rb");
+										if(fp)
+										{
+											data[i].data.bas.basic[j].tok[k].data2=(char *)malloc(sizeof(bin_seg));
+											err=false;
+											bin_load(data[i].data.bas.basic[j].tok[k].data, fp, (bin_seg *)data[i].data.bas.basic[j].tok[k].data2, NULL);
+											if(err)
+											{
+												fprintf(stderr, "bast: Linker: failed to attach BINARY segment\n\t%s:%u\n", data[i].name, j);
+												return(EXIT_FAILURE);
+											}
+										}
+										else
 										{
-											fprintf(stderr, "bast: Linker: failed to attach BINARY segment\n\t%s:%u\n", data[i].name, j);
+											fprintf(stderr, "bast: Linker: failed to open rlinked file %s\n\t%s:%u\n", data[i].data.bas.basic[j].tok[k].data, data[i].name, j);
 											return(EXIT_FAILURE);
 										}
 									}
 									else
 									{
-										fprintf(stderr, "bast: Linker: failed to open rlinked file %s\n\t%s:%u\n", data[i].data.bas.basic[j].tok[k].data, data[i].name, j);
+										fprintf(stderr, "bast: Linker: Internal error: TOKEN_RLINK without filename\n\t%s:%u", data[i].name, j);
 										return(EXIT_FAILURE);
 									}
 								}
-								else
+								else if(data[i].data.bas.basic[j].tok[k].tok==TOKEN_LOADER)
 								{
-									fprintf(stderr, "bast: Linker: Internal error: TOKEN_RLINK without filename\n\t%s:%u", data[i].name, j);
-									return(EXIT_FAILURE);
+									if(tg->type==SNAPSHOT) // CODE is already in memory, so !load expands to nothing
+									{
+										data[i].data.bas.basic[j].tok[k].data2=NULL;
+										continue;
+									}
+									loadinfo *ld=mkloader(data, nsegs, i, tg->type==DISK, tg->headerless);
+									data[i].data.bas.basic[j].tok[k].data2=(char *)ld;
+									if(!ld->nblocks)
+										fprintf(stderr, "bast: Linker: Warning: !load with no CODE segments following\n\t%s:%u\n", data[i].name, j);
 								}
 							}
 						}
-					}
-					else if(*data[i].data.bas.basic[j].text=='.')
-					{
-						if(isvalidlabel(data[i].data.bas.basic[j].text+1))
+						else if(*data[i].data.bas.basic[j].text=='.')
 						{
-							label lbl;
-							lbl.text=strdup(data[i].data.bas.basic[j].text+1);
-							lbl.seg=i;
-							lbl.line=num;
-							lbl.sline=j;
-							addlabel(&nlabels, &labels, lbl);
+							if(isvalidlabel(data[i].data.bas.basic[j].text+1))
+							{
+								label lbl;
+								lbl.text=strdup(data[i].data.bas.basic[j].text+1);
+								lbl.seg=i;
+								lbl.line=num;
+								lbl.sline=j;
+								addlabel(&nlabels, &labels, lbl);
+							}
 						}
 					}
-				}
-				buildbas(&data[i].data.bas, false);
-				if(data[i].data.bas.blen==-1)
-				{
-					fprintf(stderr, "bast: Failed to link BASIC segment %s\n", data[i].name);
-					return(EXIT_FAILURE);
-				}
-				if(data[i].data.bas.renum) data[i].data.bas.renum=2;
-			break;
-			case BINARY:
-				// TODO: export symbol table (we don't have symbols in object files yet)
-				// Nothing else on pass 1
-			break;
-			default:
-				fprintf(stderr, "bast: Linker: Internal error: Bad segment-type %u\n", data[i].type);
-				return(EXIT_FAILURE);
-			break;
-		}
-	}
-	// PASS 2: Replace labels with the linenumbers/addresses to which they point
-	for(i=0;i<nsegs;i++)
-	{
-		fprintf(stderr, "bast: Linker (Pass 2): %s\n", data[i].name);
-		switch(data[i].type)
-		{
-			case BASIC:
-				if(data[i].data.bas.line<0)
-				{
-					if(!data[i].data.bas.lline)
-					{
-						fprintf(stderr, "bast: Linker: Internal error: line<0 but lline=NULL, %s\n", data[i].name);
-						return(EXIT_FAILURE);
-					}
-					int l;
-					for(l=0;l<nlabels;l++)
+					if(Oshortnumbers&&!Ocutnumbers) // %labels already placed get their shortest text; the rest stay 5 digits
 					{
-						// TODO limit label scope to this file & the files it has #imported
-						if((data[labels[l].seg].type==BASIC) && (strcmp(data[i].data.bas.lline, labels[l].text)==0))
+						int j;
+						for(j=0;j<data[i].data.bas.nlines;j++)
 						{
-							data[i].data.bas.line=labels[l].line;
-							break;
+							int k;
+							for(k=0;k<data[i].data.bas.basic[j].ntok;k++)
+							{
+								token *t=&data[i].data.bas.basic[j].tok[k];
+								if((t->tok!=TOKEN_LABEL)||!t->data) continue;
+								int l;
+								for(l=0;l<nlabels;l++)
+								{
+									if((data[labels[l].seg].type==BASIC) && (strcmp(t->data, labels[l].text)==0))
+									{
+										char text[32];
+										zxshort(text, labels[l].line+t->index, NULL);
+										t->dl=strlen(text);
+										break;
+									}
+								}
+							}
 						}
 					}
-					if(l==nlabels)
+					buildbas(&data[i].data.bas, false);
+					if(data[i].data.bas.blen==-1)
 					{
-						fprintf(stderr, "bast: Linker: Undefined label %s\n\t%s:#pragma line\n", data[i].data.bas.lline, data[i].name);
+						fprintf(stderr, "bast: Failed to link BASIC segment %s\n", data[i].name);
 						return(EXIT_FAILURE);
 					}
-				}
-				int j;
-				for(j=0;j<data[i].data.bas.nlines;j++)
-				{
-					int k;
-					for(k=0;k<data[i].data.bas.basic[j].ntok;k++)
+					if(data[i].data.bas.renum) data[i].data.bas.renum=2;
+				break;
+				case BINARY:
+					// TODO: export symbol table (we don't have symbols in object files yet)
+					// Nothing else on pass 1
+				break;
+				default:
+					fprintf(stderr, "bast: Linker: Internal error: Bad segment-type %u\n", data[i].type);
+					return(EXIT_FAILURE);
+				break;
+			}
+		}
+		// Check that the BASIC will fit, with the largest of its overlays
+		for(i=0;i<nsegs;i++)
+		{
+			if(data[i].type!=BASIC) continue;
+			bas_seg *bas=&data[i].data.bas;
+			if(bas->blen>0xFFFF)
+			{
+				fprintf(stderr, "bast: BASIC segment %s is too long (%u bytes)\n", data[i].name, bas->blen);
+				return(EXIT_FAILURE);
+			}
+			if(bas->ovparent>=0)
+			{
+				if(bas->blen>data[bas->ovparent].data.bas.ovsize)
+					fprintf(stderr, "bast: Warning: overlay %s is %u bytes, more than the %u requested\n", data[i].name, bas->blen, data[bas->ovparent].data.bas.ovsize);
+				continue;
+			}
+			int total=bas->blen, j;
+			for(j=i+1;j<nsegs;j++)
+				if((data[j].type==BASIC)&&(data[j].data.bas.ovparent==i))
+					total=max(total, bas->blen+data[j].data.bas.blen);
+			if(total>BASMAX)
+				fprintf(stderr, "bast: Warning: BASIC segment %s needs %u bytes, but only %u are free on a 48K Spectrum (before variables)%s\n", data[i].name, total, BASMAX, bas->ovstart>=0?"":"; consider #pragma overlay");
+		}
+		// PASS 2: Replace labels with the linenumbers/addresses to which they point
+		for(i=0;i<nsegs;i++)
+		{
+			fprintf(stderr, "bast: Linker (Pass 2): %s\n", data[i].name);
+			switch(data[i].type)
+			{
+				case BASIC:
+					if(data[i].data.bas.line<0)
+					{
+						if(!data[i].data.bas.lline)
+						{
+							fprintf(stderr, "bast: Linker: Internal error: line<0 but lline=NULL, %s\n", data[i].name);
+							return(EXIT_FAILURE);
+						}
+						int l;
+						for(l=0;l<nlabels;l++)
+						{
+							// TODO limit label scope to this file & the files it has #imported
+							if((data[labels[l].seg].type==BASIC) && (strcmp(data[i].data.bas.lline, labels[l].text)==0))
+							{
+								data[i].data.bas.line=labels[l].line;
+								break;
+							}
+						}
+						if(l==nlabels)
+						{
+							fprintf(stderr, "bast: Linker: Undefined label %s\n\t%s:#pragma line\n", data[i].data.bas.lline, data[i].name);
+							return(EXIT_FAILURE);
+						}
+					}
+					int j;
+					for(j=0;j<data[i].data.bas.nlines;j++)
 					{
-						if(data[i].data.bas.basic[j].tok[k].tok==TOKEN_LABEL)
+						int k;
+						for(k=0;k<data[i].data.bas.basic[j].ntok;k++)
 						{
-							int l;
-							for(l=0;l<nlabels;l++)
+							if(data[i].data.bas.basic[j].tok[k].tok==TOKEN_LABEL)
 							{
-								// TODO limit label scope to this file & the files it has #imported
-								if((data[labels[l].seg].type==BASIC) && (strcmp(data[i].data.bas.basic[j].tok[k].data, labels[l].text)==0))
+								int l;
+								for(l=0;l<nlabels;l++)
 								{
-									if(debug) fprintf(stderr, "bast: Linker: expanded %%%s", data[i].data.bas.basic[j].tok[k].data);
-									if(data[i].data.bas.basic[j].tok[k].index)
-									{
-										if(debug) fprintf(stderr, "%s%02x", data[i].data.bas.basic[j].tok[k].index>0?"+":"-", abs(data[i].data.bas.basic[j].tok[k].index));
-									}
-									data[i].data.bas.basic[j].tok[k].tok=TOKEN_ZXFLOAT;
-									if(Ocutnumbers)
+									// TODO limit label scope to this file & the files it has #imported
+									if((data[labels[l].seg].type==BASIC) && (strcmp(data[i].data.bas.basic[j].tok[k].data, labels[l].text)==0))
 									{
-										data[i].data.bas.basic[j].tok[k].data=strdup(".");
-										if(debug) fprintf(stderr, " to %u (cut)\n", labels[l].line+data[i].data.bas.basic[j].tok[k].index);
-									}
-									else
-									{
-										data[i].data.bas.basic[j].tok[k].data=(char *)malloc(6);
-										sprintf(data[i].data.bas.basic[j].tok[k].data, "%05u", labels[l].line+data[i].data.bas.basic[j].tok[k].index);
+										if(debug) fprintf(stderr, "bast: Linker: expanded %%%s", data[i].data.bas.basic[j].tok[k].data);
+										if(data[i].data.bas.basic[j].tok[k].index)
+										{
+											if(debug) fprintf(stderr, "%s%02x", data[i].data.bas.basic[j].tok[k].index>0?"+":"-", abs(data[i].data.bas.basic[j].tok[k].index));
+										}
+										data[i].data.bas.basic[j].tok[k].tok=TOKEN_ZXFLOAT;
+										if(data[i].data.bas.basic[j].tok[k].dl) // sized by short-numbers in pass 1
+										{
+											data[i].data.bas.basic[j].tok[k].data=(char *)malloc(32);
+											zxshort(data[i].data.bas.basic[j].tok[k].data, labels[l].line+data[i].data.bas.basic[j].tok[k].index, NULL);
+											data[i].data.bas.basic[j].tok[k].dl=0;
+										}
+										else
+										{
+											data[i].data.bas.basic[j].tok[k].data=(char *)malloc(6);
+											sprintf(data[i].data.bas.basic[j].tok[k].data, "%05u", labels[l].line+data[i].data.bas.basic[j].tok[k].index);
+										}
 										if(debug) fprintf(stderr, " to %s\n", data[i].data.bas.basic[j].tok[k].data);
+										data[i].data.bas.basic[j].tok[k].data2=(char *)malloc(6);
+										zxfloat(data[i].data.bas.basic[j].tok[k].data2, labels[l].line+data[i].data.bas.basic[j].tok[k].index);
+										break;
 									}
-									data[i].data.bas.basic[j].tok[k].data2=(char *)malloc(6);
-									zxfloat(data[i].data.bas.basic[j].tok[k].data2, labels[l].line+data[i].data.bas.basic[j].tok[k].index);
-									break;
+								}
+								if(l==nlabels)
+								{
+									fprintf(stderr, "bast: Linker: Undefined label %s\n\t"LOC"\n", data[i].data.bas.basic[j].tok[k].data, data[i].name, j);
+									return(EXIT_FAILURE);
 								}
 							}
-							if(l==nlabels)
-							{
-								fprintf(stderr, "bast: Linker: Undefined label %s\n\t"LOC"\n", data[i].data.bas.basic[j].tok[k].data, data[i].name, j);
-								return(EXIT_FAILURE);
-							}
-						}
-						else if(data[i].data.bas.basic[j].tok[k].tok==TOKEN_PTRLBL)
-						{
-							int l;
-							for(l=0;l<nlabels;l++)
+							else if(data[i].data.bas.basic[j].tok[k].tok==TOKEN_PTRLBL)
 							{
-								// TODO limit label scope to this file & the files it has #imported
-								if((data[labels[l].seg].type==BASIC) && (strcmp(data[i].data.bas.basic[j].tok[k].data, labels[l].text)==0))
+								int l;
+								for(l=0;l<nlabels;l++)
 								{
-									if(debug) fprintf(stderr, "bast: Linker: expanded @%s", data[i].data.bas.basic[j].tok[k].data);
-									if(data[i].data.bas.basic[j].tok[k].index)
-									{
-										if(debug) fprintf(stderr, "%s%02x", data[i].data.bas.basic[j].tok[k].index>0?"+":"-", abs(data[i].data.bas.basic[j].tok[k].index));
-									}
-									data[i].data.bas.basic[j].tok[k].tok=TOKEN_ZXFLOAT;
-									if(Ocutnumbers)
-									{
-										data[i].data.bas.basic[j].tok[k].data=strdup(".");
-										if(debug) fprintf(stderr, " to %u (cut)\n", (unsigned int)data[labels[l].seg].data.bas.basic[labels[l].sline].offset+data[i].data.bas.basic[j].tok[k].index);
-									}
-									else
+									// TODO limit label scope to this file & the files it has #imported
+									if((data[labels[l].seg].type==BASIC) && (strcmp(data[i].data.bas.basic[j].tok[k].data, labels[l].text)==0))
 									{
+										if(debug) fprintf(stderr, "bast: Linker: expanded @%s", data[i].data.bas.basic[j].tok[k].data);
+										if(data[i].data.bas.basic[j].tok[k].index)
+										{
+											if(debug) fprintf(stderr, "%s%02x", data[i].data.bas.basic[j].tok[k].index>0?"+":"-", abs(data[i].data.bas.basic[j].tok[k].index));
+										}
+										data[i].data.bas.basic[j].tok[k].tok=TOKEN_ZXFLOAT;
 										data[i].data.bas.basic[j].tok[k].data=(char *)malloc(6);
 										sprintf(data[i].data.bas.basic[j].tok[k].data, "%05u", (unsigned int)data[labels[l].seg].data.bas.basic[labels[l].sline].offset+data[i].data.bas.basic[j].tok[k].index);
 										if(debug) fprintf(stderr, " to %s\n", data[i].data.bas.basic[j].tok[k].data);
+										data[i].data.bas.basic[j].tok[k].data2=(char *)malloc(6);
+										zxfloat(data[i].data.bas.basic[j].tok[k].data2, data[labels[l].seg].data.bas.basic[labels[l].sline].offset+data[i].data.bas.basic[j].tok[k].index);
+										break;
 									}
-									data[i].data.bas.basic[j].tok[k].data2=(char *)malloc(6);
-									zxfloat(data[i].data.bas.basic[j].tok[k].data2, data[labels[l].seg].data.bas.basic[labels[l].sline].offset+data[i].data.bas.basic[j].tok[k].index);
-									break;
+								}
+								if(l==nlabels)
+								{
+									fprintf(stderr, "bast: Linker: Undefined label %s\n\t"LOC"\n", data[i].data.bas.basic[j].tok[k].data, data[i].name, j);
+									return(EXIT_FAILURE);
 								}
 							}
-							if(l==nlabels)
+						}
+					}
+				break;
+				case BINARY:
+					if(data[i].data.bin.nbytes)
+					{
+						int j;
+						for(j=0;j<data[i].data.bin.nbytes;j++)
+						{
+							switch(data[i].data.bin.bytes[j].type)
 							{
-								fprintf(stderr, "bast: Linker: Undefined label %s\n\t"LOC"\n", data[i].data.bas.basic[j].tok[k].data, data[i].name, j);
-								return(EXIT_FAILURE);
+								case BYTE:
+									// do nothing
+								break;
+								// TODO LBL, LBM (labelpointer parsing)
+								default:
+									fprintf(stderr, "bast: Linker: Bad byte-type %u\n\t%s+0x%04X\n", data[i].data.bin.bytes[j].type, data[i].name, j);
+									return(EXIT_FAILURE);
+								break;
 							}
 						}
 					}
-				}
-			break;
-			case BINARY:
-				if(data[i].data.bin.nbytes)
+				break;
+				default:
+					fprintf(stderr, "bast: Linker: Internal error: Bad segment-type %u\n", data[i].type);
+					return(EXIT_FAILURE);
+				break;
+			}
+		}
+		fprintf(stderr, "bast: Linker passed all segments\n");
+		/* END: LINKER & LABELS */
+		
+		/* CREATE OUTPUT */
+		switch(tg->type)
+		{
+			case TAPE:
+			case WAV:
+				fprintf(stderr, "bast: Creating %s output\n", (tg->type==WAV)?"WAV":"TAPE");
+				if(nsegs)
 				{
-					int j;
-					for(j=0;j<data[i].data.bin.nbytes;j++)
+					tapeout tape;
+					tape.fp=(tg->type==WAV)&&(strcmp(tg->file, "-")==0)?stdout:fopen(tg->file, "wb");
+					if(!tape.fp)
 					{
-						switch(data[i].data.bin.bytes[j].type)
+						fprintf(stderr, "bast: Could not open output file %s for writing!\n", tg->file);
+						return(EXIT_FAILURE);
+					}
+					tape.wav=(tg->type==WAV);
+					tape.rate=tg->wavrate;
+					tape.speed=tg->wavspeed;
+					if(tape.wav)
+						wav_start(&tape);
+					int i;
+					for(i=0;i<nsegs;i++)
+					{
+						unsigned char hdr[18], *blk;
+						int j, len;
+						hdr[0]=0x00; // HEADER
+						memset(hdr+2, ' ', 10);
+						memcpy(hdr+2, data[i].name, min(10, strlen(data[i].name)));
+						switch(data[i].type)
 						{
-							case BYTE:
-								// do nothing
+							case BASIC:
+								hdr[1]=0; // PROGRAM
+								buildbas(&data[i].data.bas, true);
+								if(data[i].data.bas.blen==-1)
+								{
+									fprintf(stderr, "bast: Failed to link BASIC segment %s\n", data[i].name);
+									return(EXIT_FAILURE);
+								}
+								len=data[i].data.bas.blen+data[i].data.bas.vlen;
+								// Parameter 1 = autostart line, or 0xFFFF
+								hdr[14]=data[i].data.bas.line?data[i].data.bas.line:0xFF;
+								hdr[15]=data[i].data.bas.line?data[i].data.bas.line>>8:0xFF;
+								// Parameter 2 = data[i].data.bas.blen; the variables (if any) follow the program
+								hdr[16]=data[i].data.bas.blen;
+								hdr[17]=data[i].data.bas.blen>>8;
+								blk=(unsigned char *)malloc(len+1);
+								memcpy(blk+1, data[i].data.bas.block, data[i].data.bas.blen);
+								if(data[i].data.bas.vlen)
+									memcpy(blk+1+data[i].data.bas.blen, data[i].data.bas.vars, data[i].data.bas.vlen);
+								free(data[i].data.bas.block);
+							break;
+							case BINARY:;
+								bin_seg *b=&data[i].data.bin;
+								hdr[1]=3; // CODE
+								len=(tg->headerless&&b->packed)?b->plen:b->nbytes;
+								// Parameter 1 = address
+								hdr[14]=b->org;
+								hdr[15]=b->org>>8;
+								// Parameter 2 = 0x8000
+								hdr[16]=0x00;
+								hdr[17]=0x80;
+								blk=(unsigned char *)malloc(len+1);
+								for(j=0;j<len;j++)
+									blk[j+1]=(tg->headerless&&b->packed)?b->packed[j]:b->bytes[j].byte;
+								free(b->bytes);
+								free(b->packed);
 							break;
-							// TODO LBL, LBM (labelpointer parsing)
 							default:
-								fprintf(stderr, "bast: Linker: Bad byte-type %u\n\t%s+0x%04X\n", data[i].data.bin.bytes[j].type, data[i].name, j);
+								fprintf(stderr, "bast: Internal error: Don't know how to make TAPE output of segment type %u\n", data[i].type);
 								return(EXIT_FAILURE);
 							break;
 						}
+						hdr[12]=len;
+						hdr[13]=len>>8;
+						blk[0]=0xFF; // DATA
+						if(tg->headerless && (data[i].type==BINARY)) // data block only; the !load in the preceding BASIC segment will LD-BYTES it
+						{
+							tape_block(&tape, blk, len+1);
+							fprintf(stderr, "bast: Wrote segment %s (headerless%s)\n", data[i].name, data[i].data.bin.packed?", compressed":"");
+						}
+						else
+						{
+							tape_block(&tape, hdr, 18);
+							tape_block(&tape, blk, len+1);
+							fprintf(stderr, "bast: Wrote segment %s\n", data[i].name);
+						}
+						free(blk);
 					}
+					if(tape.wav)
+						wav_finish(&tape);
+					if(tape.fp!=stdout)
+						fclose(tape.fp);
 				}
-			break;
-			default:
-				fprintf(stderr, "bast: Linker: Internal error: Bad segment-type %u\n", data[i].type);
-				return(EXIT_FAILURE);
-			break;
-		}
-	}
-	fprintf(stderr, "bast: Linker passed all segments\n");
-	/* END: LINKER & LABELS */
-	
-	/* CREATE OUTPUT */
-	switch(outtype)
-	{
-		case TAPE:
-			fprintf(stderr, "bast: Creating TAPE output\n");
-			if(nsegs)
-			{
-				FILE *fout=fopen(outfile, "wb");
-				if(!fout)
+				else
 				{
-					fprintf(stderr, "bast: Could not open output file %s for writing!\n", outfile);
+					fprintf(stderr, "bast: There are no segments to write!\n");
 					return(EXIT_FAILURE);
 				}
-				int i;
-				for(i=0;i<nsegs;i++)
+			break;
+			case SNAPSHOT:
+				fprintf(stderr, "bast: Creating SNAPSHOT output\n");
+				if(nsegs)
 				{
-					// write header
-					fputc(0x13, fout);
-					fputc(0x00, fout);
-					unsigned char cksum=0;
-					fputc(0x00, fout); // HEADER
-					int j;
-					char name[10];
-					switch(data[i].type)
-					{
-						case BASIC:
-							fputc(0, fout); // PROGRAM
-							memset(name, ' ', 10);
-							memcpy(name, data[i].name, min(10, strlen(data[i].name)));
-							for(j=0;j<10;j++)
-							{
-								fputc(name[j], fout);
-								cksum^=name[j];
-							}
-							buildbas(&data[i].data.bas, true);
-							if(data[i].data.bas.blen==-1)
+					unsigned char *mem=(unsigned char *)calloc(0x10000, 1);
+					unsigned char *banks[8]; // 16K RAM banks; 5, 2 and 0 are paged in at 0x4000, 0x8000 and 0xC000
+					bas_seg *bas=NULL;
+					const char *ext=strrchr(tg->file, '.');
+					bool z80=ext&&(strcasecmp(ext, ".z80")==0), m128=false;
+					int i;
+					for(i=0;i<8;i++)
+						banks[i]=NULL;
+					banks[5]=mem+0x4000;
+					banks[2]=mem+0x8000;
+					banks[0]=mem+0xC000;
+					for(i=0;i<nsegs;i++)
+					{
+						if(data[i].type!=BASIC) continue;
+						if(bas)
+						{
+							fprintf(stderr, "bast: Warning: only one BASIC segment can be in a snapshot; ignoring %s\n", data[i].name);
+							continue;
+						}
+						bas=&data[i].data.bas;
+						buildbas(bas, true);
+						if(bas->blen==-1)
+						{
+							fprintf(stderr, "bast: Failed to link BASIC segment %s\n", data[i].name);
+							return(EXIT_FAILURE);
+						}
+						fprintf(stderr, "bast: Placed segment %s at 0x5CCB\n", data[i].name);
+					}
+					int lo=0x10000; // lowest CODE address above the BASIC, for RAMTOP
+					int worksp=0x5CCB+(bas?bas->blen+((bas->vars)?bas->vlen:0):0)+3; // where mksysvars() will put WORKSP: after the variables' end marker and the edit line
+					for(i=0;i<nsegs;i++)
+					{
+						if(data[i].type!=BINARY) continue;
+						bin_seg *b=&data[i].data.bin;
+						if((b->org<0x4000)||(b->org+b->nbytes>0x10000))
+						{
+							fprintf(stderr, "bast: CODE segment %s (0x%04X, %u bytes) doesn't fit in 48K RAM\n", data[i].name, b->org, b->nbytes);
+							return(EXIT_FAILURE);
+						}
+						int j;
+						if(b->bank>=0)
+						{
+							if(z80)
 							{
-								fprintf(stderr, "bast: Failed to link BASIC segment %s\n", data[i].name);
+								fprintf(stderr, "bast: Banked CODE segment %s needs a 128K snapshot; use .sna output\n", data[i].name);
 								return(EXIT_FAILURE);
 							}
-							fputc(data[i].data.bas.blen, fout);
-							cksum^=data[i].data.bas.blen&0xFF;
-							fputc(data[i].data.bas.blen>>8, fout);
-							cksum^=data[i].data.bas.blen>>8;
-							if(data[i].data.bas.line) // Parameter 1 = autostart line
-							{
-								fputc(data[i].data.bas.line, fout);
-								cksum^=data[i].data.bas.line&0xFF;
-								fputc(data[i].data.bas.line>>8, fout);
-								cksum^=data[i].data.bas.line>>8;
-							}
-							else // Parameter 1 = 0xFFFF
-							{
-								fputc(0xFF, fout);
-								fputc(0xFF, fout);
-							}
-							// Parameter 2 = data[i].data.bas.blen
-							fputc(data[i].data.bas.blen, fout);
-							cksum^=data[i].data.bas.blen&0xFF;
-							fputc(data[i].data.bas.blen>>8, fout);
-							cksum^=data[i].data.bas.blen>>8;
-							fputc(cksum, fout);
-							// write data block
-							fputc((data[i].data.bas.blen+2), fout);
-							fputc((data[i].data.bas.blen+2)>>8, fout);
-							fputc(0xFF, fout); // DATA
-							cksum=0xFF;
-							for(j=0;j<data[i].data.bas.blen;j++)
-							{
-								fputc(data[i].data.bas.block[j], fout);
-								cksum^=data[i].data.bas.block[j];
-							}
-							fputc(cksum, fout);
-							free(data[i].data.bas.block);
-						break;
-						case BINARY:
-							fputc(3, fout); // CODE
-							cksum^=3;
-							memset(name, ' ', 10);
-							memcpy(name, data[i].name, min(10, strlen(data[i].name)));
-							for(j=0;j<10;j++)
+							if(!banks[b->bank])
+								banks[b->bank]=(unsigned char *)calloc(0x4000, 1);
+							for(j=0;j<b->nbytes;j++)
+								banks[b->bank][b->org-0xC000+j]=b->bytes[j].byte;
+							m128=true;
+							lo=min(lo, 0xC000); // keep the stack out of the paged memory
+							fprintf(stderr, "bast: Placed segment %s at 0x%04X in bank %d\n", data[i].name, b->org, b->bank);
+							continue;
+						}
+						if((b->org<worksp+0x100)&&(b->org+b->nbytes>0x5CCB)) // screen, printer buffer and system variables are fine; the program and its workspace aren't
+						{
+							fprintf(stderr, "bast: CODE segment %s (0x%04X, %u bytes) overlaps BASIC program and workspace (0x5CCB to 0x%04X)\n", data[i].name, b->org, b->nbytes, worksp+0x100);
+							return(EXIT_FAILURE);
+						}
+						if(b->org>=worksp)
+							lo=min(lo, b->org);
+					}
+					if(mksysvars(mem, bas, lo)<0)
+						return(EXIT_FAILURE);
+					if(m128)
+						mem[0x5B5C]=0x10; // BANKM: bank 0, 48K BASIC ROM
+					for(i=0;i<nsegs;i++) // now the CODE, over the default screen and system variables
+					{
+						if((data[i].type!=BINARY)||(data[i].data.bin.bank>=0)) continue;
+						bin_seg *b=&data[i].data.bin;
+						int j;
+						for(j=0;j<b->nbytes;j++)
+							mem[b->org+j]=b->bytes[j].byte;
+						fprintf(stderr, "bast: Placed segment %s at 0x%04X\n", data[i].name, b->org);
+					}
+					int line=bas?bas->line:0;
+					if(!bas&&(tg->usr<0))
+					{
+						fprintf(stderr, "bast: Snapshot has no BASIC to run; use --usr to give a start address\n");
+						return(EXIT_FAILURE);
+					}
+					// registers: as the ROM leaves them while running BASIC
+					int ramtop=mem[0x5CB2]|(mem[0x5CB3]<<8);
+					int sp=ramtop-3, pc;
+					unsigned int bc=0;
+					if(tg->usr>=0)
+					{
+						pc=bc=tg->usr; // m/c returns via MAIN-4 to report 0 OK
+						fprintf(stderr, "bast: Snapshot starts at USR %u\n", tg->usr);
+					}
+					else if(line)
+					{
+						pc=0x1B7D; // STMT-R-1, as though GO TO line
+						fprintf(stderr, "bast: Snapshot starts at line %u\n", line);
+					}
+					else
+					{
+						pc=0x1303; // MAIN-4: report 0 OK and enter the editor
+						sp+=2;
+					}
+					FILE *fout=fopen(tg->file, "wb");
+					if(!fout)
+					{
+						fprintf(stderr, "bast: Could not open output file %s for writing!\n", tg->file);
+						return(EXIT_FAILURE);
+					}
+					unsigned char hdr[30];
+					memset(hdr, 0, 30);
+					if(z80) // version 1 .z80, uncompressed
+					{
+						hdr[2]=bc;hdr[3]=bc>>8; // BC
+						hdr[6]=pc;hdr[7]=pc>>8; // PC
+						hdr[8]=sp;hdr[9]=sp>>8; // SP
+						hdr[10]=0x3F; // I
+						hdr[12]=7<<1; // border 7, not compressed
+						hdr[19]=0x58;hdr[20]=0x27; // HL'=0x2758, for the calculator
+						hdr[23]=0x3A;hdr[24]=0x5C; // IY=ERR_NR
+						hdr[27]=hdr[28]=1; // IFF1, IFF2
+						hdr[29]=1; // IM 1
+						fwrite(hdr, 1, 30, fout);
+					}
+					else // .sna; PC is pushed onto the stack (or, for 128K, follows the 48K image)
+					{
+						if(!m128)
+						{
+							sp-=2;
+							mem[sp]=pc;
+							mem[sp+1]=pc>>8;
+						}
+						hdr[0]=0x3F; // I
+						hdr[1]=0x58;hdr[2]=0x27; // HL'=0x2758, for the calculator
+						hdr[13]=bc;hdr[14]=bc>>8; // BC
+						hdr[15]=0x3A;hdr[16]=0x5C; // IY=ERR_NR
+						hdr[19]=0x04; // IFF2
+						hdr[23]=sp;hdr[24]=sp>>8; // SP
+						hdr[25]=1; // IM 1
+						hdr[26]=7; // border
+						fwrite(hdr, 1, 27, fout);
+					}
+					fwrite(mem+0x4000, 1, 0xC000, fout);
+					if(m128) // PC, port 0x7FFD, TR-DOS not paged, then the other banks in order
+					{
+						unsigned char ext128[4]={pc, pc>>8, 0x10, 0};
+						fwrite(ext128, 1, 4, fout);
+						for(i=1;i<8;i++)
+						{
+							if((i==2)||(i==5)) continue;
+							if(!banks[i])
+								banks[i]=(unsigned char *)calloc(0x4000, 1);
+							fwrite(banks[i], 1, 0x4000, fout);
+							free(banks[i]);
+						}
+						fprintf(stderr, "bast: Wrote 128K snapshot\n");
+					}
+					fclose(fout);
+					free(mem);
+				}
+				else
+				{
+					fprintf(stderr, "bast: There are no segments to write!\n");
+					return(EXIT_FAILURE);
+				}
+			break;
+			case DISK:
+				fprintf(stderr, "bast: Creating DISK output\n");
+				if(nsegs)
+				{
+					int nfiles=0;
+					dskfile *files=(dskfile *)malloc((nsegs+1)*sizeof(dskfile));
+					int i;
+					if(tg->autoboot)
+					{
+						for(i=0;i<nsegs;i++)
+							if(strcasecmp(data[i].name, "DISK")==0) break;
+						if(i<nsegs)
+						{
+							fprintf(stderr, "bast: Warning: --autoboot, but there is already a segment named DISK\n");
+						}
+						else
+						{
+							for(i=0;(i<nsegs)&&(data[i].type!=BASIC);i++);
+							if(i==nsegs)
 							{
-								fputc(name[j], fout);
-								cksum^=name[j];
+								fprintf(stderr, "bast: --autoboot needs a BASIC segment to boot\n");
+								return(EXIT_FAILURE);
 							}
-							fputc(data[i].data.bin.nbytes, fout);
-							cksum^=data[i].data.bin.nbytes&0xFF;
-							fputc(data[i].data.bin.nbytes>>8, fout);
-							cksum^=data[i].data.bin.nbytes>>8;
-							// Parameter 1 = address
-							fputc(data[i].data.bin.org, fout);
-							cksum^=data[i].data.bin.org&0xFF;
-							fputc(data[i].data.bin.org>>8, fout);
-							cksum^=data[i].data.bin.org>>8;
-							// Parameter 2 = 0x8000
-							fputc(0x00, fout);
-							fputc(0x80, fout);
-							cksum^=0x80;
-							fputc(cksum, fout);
-							// write data block
-							fputc((data[i].data.bin.nbytes+2), fout);
-							fputc((data[i].data.bin.nbytes+2)>>8, fout);
-							fputc(0xFF, fout); // DATA
-							cksum=0xFF;
-							for(j=0;j<data[i].data.bin.nbytes;j++)
+							// 10 LOAD "<file>"; the file's own header gives its autostart
+							dskfile *f=&files[nfiles++];
+							strcpy(f->name, "DISK");
+							char fn[13];
+							dskname(fn, data[i].name, false);
+							f->len=strlen(fn)+8;
+							f->data=(unsigned char *)malloc(f->len);
+							f->data[0]=0;f->data[1]=10;
+							f->data[2]=f->len-4;f->data[3]=0;
+							f->data[4]=0xEF;f->data[5]='"';
+							memcpy(f->data+6, fn, strlen(fn));
+							f->data[f->len-2]='"';
+							f->data[f->len-1]=0x0D;
+							f->type=0;
+							f->param1=10;
+							f->param2=f->len;
+							fprintf(stderr, "bast: Added autoboot loader DISK for %s\n", fn);
+						}
+					}
+					for(i=0;i<nsegs;i++)
+					{
+						dskfile *f=&files[nfiles++];
+						int j;
+						switch(data[i].type)
+						{
+							case BASIC:
+								dskname(f->name, data[i].name, false);
+								buildbas(&data[i].data.bas, true);
+								if(data[i].data.bas.blen==-1)
+								{
+									fprintf(stderr, "bast: Failed to link BASIC segment %s\n", data[i].name);
+									return(EXIT_FAILURE);
+								}
+								f->type=0;
+								f->len=data[i].data.bas.blen+data[i].data.bas.vlen;
+								f->data=(unsigned char *)realloc(data[i].data.bas.block, max(f->len, 1));
+								if(data[i].data.bas.vlen)
+									memcpy(f->data+data[i].data.bas.blen, data[i].data.bas.vars, data[i].data.bas.vlen);
+								f->param1=data[i].data.bas.line?data[i].data.bas.line:0x8000;
+								f->param2=data[i].data.bas.blen;
+							break;
+							case BINARY:
+								dskname(f->name, data[i].name, true);
+								f->type=3;
+								f->len=data[i].data.bin.nbytes;
+								f->data=(unsigned char *)malloc(f->len);
+								for(j=0;j<f->len;j++)
+									f->data[j]=data[i].data.bin.bytes[j].byte;
+								f->param1=data[i].data.bin.org;
+								f->param2=0x8000;
+							break;
+							default:
+								fprintf(stderr, "bast: Internal error: Don't know how to make DISK output of segment type %u\n", data[i].type);
+								return(EXIT_FAILURE);
+							break;
+						}
+						for(j=0;j<nfiles-1;j++)
+						{
+							if(strcmp(files[j].name, f->name)==0)
 							{
-								fputc(data[i].data.bin.bytes[j].byte, fout);
-								cksum^=data[i].data.bin.bytes[j].byte;
+								fprintf(stderr, "bast: Segment %s would overwrite file %s on disk\n", data[i].name, f->name);
+								return(EXIT_FAILURE);
 							}
-							fputc(cksum, fout);
-							free(data[i].data.bin.bytes);
-						break;
-						default:
-							fprintf(stderr, "bast: Internal error: Don't know how to make TAPE output of segment type %u\n", data[i].type);
-							return(EXIT_FAILURE);
-						break;
+						}
+					}
+					FILE *fout=fopen(tg->file, "wb");
+					if(!fout)
+					{
+						fprintf(stderr, "bast: Could not open output file %s for writing!\n", tg->file);
+						return(EXIT_FAILURE);
+					}
+					if(writedsk(fout, files, nfiles))
+					{
+						fclose(fout);
+						return(EXIT_FAILURE);
 					}
-					
-					fprintf(stderr, "bast: Wrote segment %s\n", data[i].name);
+					fclose(fout);
+					for(i=0;i<nfiles;i++)
+						free(files[i].data);
+					free(files);
 				}
-				fclose(fout);
-			}
-			else
-			{
-				fprintf(stderr, "bast: There are no segments to write!\n");
+				else
+				{
+					fprintf(stderr, "bast: There are no segments to write!\n");
+					return(EXIT_FAILURE);
+				}
+			break;
+			default:
+				fprintf(stderr, "bast: Internal error: Bad output type %u\n", tg->type);
 				return(EXIT_FAILURE);
-			}
-		break;
-		default:
-			fprintf(stderr, "bast: Internal error: Bad output type %u\n", outtype);
-			return(EXIT_FAILURE);
-		break;
-	}
-	/* END: CREATE OUTPUT */
-	
-	if(emu && outtype==TAPE)
-	{
-		char *emucmd=getenv("EMU");
-		if(emucmd)
+			break;
+		}
+		/* END: CREATE OUTPUT */
+		
+		if(tg->emu && ((tg->type==TAPE)||(tg->type==SNAPSHOT)||(tg->type==DISK)))
 		{
-			char *cmd;
-			int l,i;
-			init_char(&cmd, &l, &i);
-			while(*emucmd)
+			char *emucmd=getenv("EMU");
+			if(emucmd)
 			{
-				if(*emucmd=='%')
+				char *cmd;
+				int l,i;
+				init_char(&cmd, &l, &i);
+				while(*emucmd)
 				{
-					append_str(&cmd, &l, &i, outfile);
-					emucmd++;
-				}
-				else
-				{
-					append_char(&cmd, &l, &i, *emucmd++);
+					if(*emucmd=='%')
+					{
+						append_str(&cmd, &l, &i, tg->file);
+						emucmd++;
+					}
+					else
+					{
+						append_char(&cmd, &l, &i, *emucmd++);
+					}
 				}
+				system(cmd);
+				free(cmd);
 			}
-			system(cmd);
-			free(cmd);
 		}
 	}
+	/* END: BUILD EACH TARGET */
+	
 	return(EXIT_SUCCESS);
 }
 
@@ -1038,6 +1967,22 @@ void append_str(char **buf, int *l, int *i, char *str)
 	}
 }
 
+void append_num(char **buf, int *l, int *i, unsigned int value, int width) // number text (zero-padded to width, so its length doesn't depend on the value) and its ZX float
+{
+	char num[12];
+	if(Ocutnumbers)
+		strcpy(num, ".");
+	else
+		sprintf(num, "%0*u", width, value);
+	append_str(buf, l, i, num);
+	append_char(buf, l, i, TOKEN_ZXFLOAT);
+	char fl[5];
+	zxfloat(fl, value);
+	int j;
+	for(j=0;j<5;j++)
+		append_char(buf, l, i, fl[j]);
+}
+
 int addinbas(int *ninbas, char ***inbas, char *arg)
 {
 	int nb=(*ninbas)+1;
@@ -1055,6 +2000,19 @@ int addinbas(int *ninbas, char ***inbas, char *arg)
 	}
 }
 
+int renumstep(bas_seg *bas) // the spacing #pragma renum will use, or 0 if the lines won't fit
+{
+	int dnum=bas->rnoffset?bas->rnoffset:10;
+	int end=bas->rnend?bas->rnend:9999;
+	while(bas->blines*dnum>end)
+	{
+		dnum--;
+		if((dnum==7)||(dnum==9))
+			dnum--;
+	}
+	return(dnum);
+}
+
 int addbasline(int *nlines, basline **basic, char *line)
 {
 	int nl=(*nlines)+1;
@@ -1094,25 +2052,86 @@ segment *addsegment(int *nsegs, segment **data)
 	}
 }
 
-void basfree(basline b)
-{
-	if(b.text) free(b.text);
-	if(b.tok) free(b.tok);
-}
-
-void tokenise(basline *b, char **inbas, int fbas, int renum)
+segment *dupsegs(segment *data, int nsegs) // deep copy of (unlinked) segments
 {
-	if(b)
+	segment *rv=(segment *)malloc(max(nsegs, 1)*sizeof(segment));
+	int i,j,k;
+	for(i=0;i<nsegs;i++)
 	{
-		int fline=b->sline;
-		if(b->tok) free(b->tok);
-		b->tok=NULL;
-		b->ntok=0;
-		int bt;
-		if(b->text && !strchr("#.\n", *b->text))
+		rv[i]=data[i];
+		rv[i].name=strdup(data[i].name);
+		switch(data[i].type)
 		{
-			char *ptr=b->text;
-			if(!renum)
+			case BASIC:;
+				bas_seg *bas=&rv[i].data.bas;
+				bas->basic=(basline *)malloc(max(bas->nlines, 1)*sizeof(basline));
+				for(j=0;j<bas->nlines;j++)
+				{
+					basline *b=&bas->basic[j];
+					*b=data[i].data.bas.basic[j];
+					b->text=strdup(b->text);
+					b->tok=(token *)malloc(max(b->ntok, 1)*sizeof(token));
+					for(k=0;k<b->ntok;k++)
+					{
+						token *t=&b->tok[k], *o=&data[i].data.bas.basic[j].tok[k];
+						*t=*o;
+						if(o->data)
+						{
+							if(o->dl>0) // embedded NULs
+							{
+								t->data=(char *)malloc(o->dl);
+								memcpy(t->data, o->data, o->dl);
+							}
+							else
+							{
+								t->data=strdup(o->data);
+							}
+						}
+						if(o->data2&&(o->tok==TOKEN_ZXFLOAT))
+						{
+							t->data2=(char *)malloc(5);
+							memcpy(t->data2, o->data2, 5);
+						}
+					}
+				}
+				if(bas->lline)
+					bas->lline=strdup(bas->lline);
+				if(bas->vars)
+				{
+					bas->vars=(char *)malloc(bas->vlen+1);
+					memcpy(bas->vars, data[i].data.bas.vars, bas->vlen);
+				}
+			break;
+			case BINARY:
+				rv[i].data.bin.bytes=(bin_byte *)malloc(max(data[i].data.bin.nbytes, 1)*sizeof(bin_byte));
+				memcpy(rv[i].data.bin.bytes, data[i].data.bin.bytes, data[i].data.bin.nbytes*sizeof(bin_byte));
+			break;
+			default:
+			break;
+		}
+	}
+	return(rv);
+}
+
+void basfree(basline b)
+{
+	if(b.text) free(b.text);
+	if(b.tok) free(b.tok);
+}
+
+void tokenise(basline *b, char **inbas, int fbas, int renum)
+{
+	if(b)
+	{
+		int fline=b->sline;
+		if(b->tok) free(b->tok);
+		b->tok=NULL;
+		b->ntok=0;
+		int bt;
+		if(b->text && !strchr("#.\n", *b->text))
+		{
+			char *ptr=b->text;
+			if(!renum)
 			{
 				while(isspace(*ptr))
 					ptr++;
@@ -1209,6 +2228,16 @@ void tokenise(basline *b, char **inbas, int fbas, int renum)
 					}
 				}
 				if(curtok) free(curtok);
+				int k;
+				for(k=0;k<b->ntok-1;k++)
+				{
+					if(b->tok[k].tok==TOKEN_LOADER) // with --headerless it becomes RANDOMIZE USR n:REM <loader>, which would swallow what follows
+					{
+						fprintf(stderr, "bast: !load must be the last statement on its line\n\t"LOC"\n", LOCARG);
+						err=true;
+						break;
+					}
+				}
 			}
 		}
 	}
@@ -1220,6 +2249,9 @@ token gettoken(char *data, int *bt)
 	rv.text=data;
 	rv.tok=0;
 	rv.data=NULL;
+	rv.dl=0;
+	rv.data2=NULL;
+	rv.index=0;
 	*bt=0;
 	if(*data<' ') // nonprinting characters (control chars, eg. colour codes)
 	{
@@ -1380,16 +2412,9 @@ token gettoken(char *data, int *bt)
 	{
 		// 0x0E		ZX floating point number (full representation in token.data is (decimal), in token.data2 is (ZXfloat[5]))
 		rv.tok=TOKEN_ZXFLOAT;
-		if(Ocutnumbers)
-		{
-			rv.data=strdup(".");
-		}
-		else
-		{
-			rv.data=(char *)malloc(endptr-data+1);
-			strncpy(rv.data, data, endptr-data);
-			rv.data[endptr-data]=0;
-		}
+		rv.data=(char *)malloc(endptr-data+1);
+		strncpy(rv.data, data, endptr-data);
+		rv.data[endptr-data]=0;
 		rv.data2=(char *)malloc(5);
 		zxfloat(rv.data2, num);
 		*bt=strlen(endptr);
@@ -1413,15 +2438,8 @@ token gettoken(char *data, int *bt)
 			*q=c;
 			*bt=strlen(q);
 			rv.tok=TOKEN_ZXFLOAT;
-			if(Ocutnumbers)
-			{
-				rv.data=strdup(".");
-			}
-			else
-			{
-				rv.data=(char *)malloc(6);
-				sprintf(rv.data, "%u", val);
-			}
+			rv.data=(char *)malloc(6);
+			sprintf(rv.data, "%u", val);
 			rv.data2=(char *)malloc(5);
 			zxfloat(rv.data2, val);
 			return(rv);
@@ -1445,15 +2463,8 @@ token gettoken(char *data, int *bt)
 			*q=c;
 			*bt=strlen(q);
 			rv.tok=TOKEN_ZXFLOAT;
-			if(Ocutnumbers)
-			{
-				rv.data=strdup(".");
-			}
-			else
-			{
-				rv.data=(char *)malloc(6);
-				sprintf(rv.data, "%u", val);
-			}
+			rv.data=(char *)malloc(6);
+			sprintf(rv.data, "%u", val);
 			rv.data2=(char *)malloc(5);
 			zxfloat(rv.data2, val);
 			return(rv);
@@ -1489,6 +2500,14 @@ token gettoken(char *data, int *bt)
 		*bt=0;
 		return(rv);
 	}
+	if((strncasecmp(data, "!load", 5)==0) && data[5] && !isalnum(data[5]))
+	{
+		rv.tok=TOKEN_LOADER;
+		rv.dl=0;
+		rv.data2=NULL;
+		*bt=strlen(data+5);
+		return(rv);
+	}
 	if(!isalpha(data[strlen(data)-1]) && !isspace(data[strlen(data)-1])) // "GO " may be the start of GO TO or GO SUB, "ON " may be the start of an SE BASIC ON ERR.  For safety's sake, we don't accept a variable name until we know it can't be anything else
 	{
 		// assume it's a variable
@@ -1530,8 +2549,8 @@ void zxfloat(char *buf, double value)
 		// 00 {00|FF}sign LSB MSB 00
 		buf[0]=0;
 		buf[1]=(i<0)?0xFF:0;
-		buf[2]=abs(i);
-		buf[3]=abs(i>>8);
+		buf[2]=i; // two's complement, if negative
+		buf[3]=i>>8;
 		buf[4]=0;
 	}
 	else
@@ -1539,7 +2558,12 @@ void zxfloat(char *buf, double value)
 		// 4mantissa + 1exponent
 		// m*2^(e-128)
 		int ex=1+floor(log2(fabs(value)));
-		unsigned long mantissa=floor(fabs(value)*exp2(32-ex)+0.5);
+		unsigned long long mantissa=floor(fabs(value)*exp2(32-ex)+0.5);
+		if(mantissa>>32) // rounded up to the next power of two
+		{
+			mantissa>>=1;
+			ex++;
+		}
 		buf[0]=ex+128;
 		buf[1]=((mantissa>>24)&0x7F)|((value<0)?0x80:0);
 		buf[2]=mantissa>>16;
@@ -1548,148 +2572,1284 @@ void zxfloat(char *buf, double value)
 	}
 }
 
-bool isvalidlabel(char *text)
+int toksize(const token *t) // bytes buildbas() writes for the token (before linking, so !link and !load count as nothing)
 {
-	if(!isalpha(*text))
-		return(false);
-	size_t s=strspn(text, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_");
-	return(!text[s]);
+	if(t->tok&0x80)
+	{
+		if((t->tok==0xEA)&&t->data) // REM, and the rest of the line
+			return(1+(t->dl?t->dl:esclen(t->data)));
+		return(1);
+	}
+	switch(t->tok)
+	{
+		case TOKEN_VAR:
+		case TOKEN_VARSTR:
+			return(strlen(t->data));
+		case TOKEN_ZXFLOAT:
+			return((Ocutnumbers?1:strlen(t->data))+6);
+		case TOKEN_STRING:
+			return(esclen(t->data)+2);
+		case TOKEN_NONPRINT:
+			return(t->data?1:0);
+		case TOKEN_LABEL:
+			return(t->data?(Ocutnumbers?7:(t->dl?t->dl:5)+6):0);
+		case TOKEN_PTRLBL:
+			return(t->data?(Ocutnumbers?7:11):0);
+		case TOKEN_RLINK:
+			return(t->data2?1+((bin_seg *)t->data2)->nbytes:0);
+		case TOKEN_LOADER:
+			return(0);
+		default:
+			return(1);
+	}
 }
 
-void addlabel(int *nlabels, label **labels, label lbl)
+int esclen(const char *p) // length of string or REM text, with "\0" escapes counting as one byte
 {
-	int nl=(*nlabels)+1;
-	label *ll=(label *)realloc(*labels, nl*sizeof(label));
-	if(ll)
+	int l=0;
+	while(*p)
 	{
-		*nlabels=nl;
-		*labels=ll;
-		ll[nl-1]=lbl;
+		if((*p=='\\')&&(p[1]=='0'))
+			p++;
+		p++;
+		l++;
 	}
+	return(l);
 }
 
-void buildbas(bas_seg *bas, bool write) // if write is false, we just compute offsets
+const char *tokname(unsigned char tok) // the text of a keyword or symbol token, or NULL
 {
-	int dbl;
-	if(write)
+	int k;
+	for(k=0;k<ntokens;k++)
+		if(tokentable[k].tok==tok)
+			return(tokentable[k].text);
+	return(NULL);
+}
+
+int ast_binprio(unsigned char tok) // priority of a binary operator, as in the ROM's table; 0 if it isn't one
+{
+	switch(tok)
 	{
-		init_char(&bas->block, &dbl, &bas->blen);
+		case '^':
+			return(10);
+		case '*':
+		case '/':
+			return(8);
+		case '+':
+		case '-':
+			return(6);
+		case '=':
+		case '<':
+		case '>':
+		case 0xC7: // <=
+		case 0xC8: // >=
+		case 0xC9: // <>
+			return(5);
+		case 0xC6: // AND
+			return(3);
+		case 0xC5: // OR
+			return(2);
+		default:
+			return(0);
 	}
-	else
+}
+
+astnode *ast_new(int type, unsigned char op)
+{
+	astnode *n=(astnode *)malloc(sizeof(astnode));
+	n->type=type;
+	n->op=op;
+	n->str=false;
+	n->size=0;
+	n->nitems=0;
+	n->items=NULL;
+	return(n);
+}
+
+void ast_tok(astnode *n, token t)
+{
+	n->items=(astitem *)realloc(n->items, ++n->nitems*sizeof(astitem));
+	n->items[n->nitems-1].tok=t;
+	n->items[n->nitems-1].node=NULL;
+}
+
+void ast_add(astnode *n, astnode *child)
+{
+	n->items=(astitem *)realloc(n->items, ++n->nitems*sizeof(astitem));
+	n->items[n->nitems-1].node=child;
+}
+
+bool ast_at(astparser *p, unsigned char tok)
+{
+	return((p->i<p->ntok)&&(p->tok[p->i].tok==tok));
+}
+
+void ast_args(astparser *p, astnode *n) // '(' {expr | ',' | TO}* ')', for subscripts, slices and FN/ATTR/POINT/SCREEN$ arguments
+{
+	ast_tok(n, p->tok[p->i++]);
+	while((p->i<p->ntok)&&!ast_at(p, ')'))
 	{
-		bas->block=NULL;
+		if(ast_at(p, ',')||ast_at(p, 0xCC)) // TO
+		{
+			ast_tok(n, p->tok[p->i++]);
+			continue;
+		}
+		astnode *e=ast_expr(p, 0);
+		if(!e) break; // not an expression; the statement gets the rest
+		ast_add(n, e);
 	}
-	int i;
-	for(i=0;i<bas->nlines;i++) // Address of first line's number MSB is 0x5CCB.  Text starts 4 bytes later
+	if(ast_at(p, ')'))
+		ast_tok(n, p->tok[p->i++]);
+}
+
+astnode *ast_postfix(astparser *p, astnode *n) // subscripts and slices
+{
+	while(n->str&&ast_at(p, '('))
 	{
-		bas->basic[i].offset=bas->blen+4+0x5CCB;
-		if(bas->basic[i].ntok)
+		astnode *ix=ast_new(AST_INDEX, '(');
+		ast_add(ix, n);
+		ast_args(p, ix);
+		ix->str=true;
+		n=ix;
+	}
+	return(n);
+}
+
+astnode *ast_operand(astparser *p) // an operand, with any prefix operators; NULL (consuming nothing) if there isn't one
+{
+	if(p->i>=p->ntok)
+		return(NULL);
+	token t=p->tok[p->i];
+	astnode *n, *e;
+	switch(t.tok)
+	{
+		case TOKEN_ZXFLOAT:
+			n=ast_new(AST_NUM, t.tok);
+			ast_tok(n, p->tok[p->i++]);
+			return(n);
+		case TOKEN_LABEL:
+		case TOKEN_PTRLBL:
+			n=ast_new(AST_LABEL, t.tok);
+			ast_tok(n, p->tok[p->i++]);
+			return(n);
+		case TOKEN_STRING:
+			n=ast_new(AST_STR, t.tok);
+			ast_tok(n, p->tok[p->i++]);
+			n->str=true;
+			return(ast_postfix(p, n));
+		case TOKEN_VAR:
+		case TOKEN_VARSTR:
+			n=ast_new(AST_VAR, t.tok);
+			ast_tok(n, p->tok[p->i++]);
+			n->str=(t.tok==TOKEN_VARSTR);
+			if(!n->str&&ast_at(p, '(')) // numeric array element
+			{
+				astnode *ix=ast_new(AST_INDEX, '(');
+				ast_add(ix, n);
+				ast_args(p, ix);
+				return(ix);
+			}
+			return(ast_postfix(p, n));
+		case '(':
+			n=ast_new(AST_PAREN, t.tok);
+			ast_args(p, n);
+			n->str=(n->nitems==3)&&n->items[1].node&&n->items[1].node->str;
+			return(ast_postfix(p, n));
+		case '-':
+		case '+':
+		case 0xC3: // NOT
+			n=ast_new(AST_UNOP, t.tok);
+			ast_tok(n, p->tok[p->i++]);
+			if(!(e=ast_expr(p, (t.tok==0xC3)?4:9)))
+			{
+				p->i--;
+				free(n->items);
+				free(n);
+				return(NULL);
+			}
+			ast_add(n, e);
+			return(n);
+		case 0xA5: // RND
+		case 0xA6: // INKEY$
+		case 0xA7: // PI
+			n=ast_new(AST_FUNC, t.tok);
+			ast_tok(n, p->tok[p->i++]);
+			n->str=(t.tok==0xA6);
+			return(n);
+		case 0xA8: // FN f(args)
+			n=ast_new(AST_FN, t.tok);
+			ast_tok(n, p->tok[p->i++]);
+			if(ast_at(p, TOKEN_VAR)||ast_at(p, TOKEN_VARSTR))
+			{
+				n->str=ast_at(p, TOKEN_VARSTR);
+				ast_tok(n, p->tok[p->i++]);
+				if(ast_at(p, '('))
+					ast_args(p, n);
+			}
+			return(ast_postfix(p, n));
+		case 0xA9: // POINT (y,x)
+		case 0xAA: // SCREEN$ (y,x)
+		case 0xAB: // ATTR (y,x)
+			n=ast_new(AST_FUNC, t.tok);
+			ast_tok(n, p->tok[p->i++]);
+			n->str=(t.tok==0xAA);
+			if(ast_at(p, '('))
+			{
+				e=ast_new(AST_PAREN, '(');
+				ast_args(p, e);
+				ast_add(n, e);
+			}
+			return(n);
+		default:
+			if(((t.tok>=0xAE)&&(t.tok<=0xC2))||(t.tok==0xC4)) // functions (and BIN), which bind tighter than any operator
+			{
+				n=ast_new(AST_FUNC, t.tok);
+				ast_tok(n, p->tok[p->i++]);
+				n->str=(t.tok==0xAE)||(t.tok==0xC1)||(t.tok==0xC2); // VAL$, STR$, CHR$
+				if((e=ast_expr(p, 16))) // not there for eg. LOAD "" CODE
+					ast_add(n, e);
+				return(n);
+			}
+			return(NULL);
+	}
+}
+
+astnode *ast_expr(astparser *p, int rbp) // an expression whose operators all bind tighter than rbp
+{
+	astnode *lhs=ast_operand(p);
+	if(!lhs)
+		return(NULL);
+	while(p->i<p->ntok)
+	{
+		int prio=ast_binprio(p->tok[p->i].tok);
+		if(prio<=rbp) // operators of equal priority associate to the left
+			break;
+		token op=p->tok[p->i++];
+		astnode *rhs=ast_expr(p, prio);
+		if(!rhs) // dangling operator; leave it to the statement
 		{
-			append_char(&bas->block, &dbl, &bas->blen, bas->basic[i].number>>8); // MSB first!!!!
-			append_char(&bas->block, &dbl, &bas->blen, bas->basic[i].number);
-			char *line;
-			int li,ll;
-			init_char(&line, &ll, &li);
-			int j;
-			for(j=0;j<bas->basic[i].ntok;j++)
+			p->i--;
+			break;
+		}
+		astnode *n=ast_new(AST_BINOP, op.tok);
+		ast_add(n, lhs);
+		ast_tok(n, op);
+		ast_add(n, rhs);
+		n->str=((op.tok=='+')||(op.tok==0xC6))&&lhs->str;
+		lhs=n;
+	}
+	return(lhs);
+}
+
+astnode *ast_stmt(astparser *p) // a statement, up to the next ':' (or, for IF, the end of the line)
+{
+	unsigned char kw=p->tok[p->i].tok;
+	astnode *n=ast_new(AST_STMT, (kw&0x80)||(kw==TOKEN_RLINK)||(kw==TOKEN_LOADER)?kw:0), *e;
+	if(n->op)
+		ast_tok(n, p->tok[p->i++]);
+	switch(n->op)
+	{
+		case 0xEA: // REM: the rest of the line is in its token
+			return(n);
+		case 0xFA: // IF cond THEN statements
+			if((e=ast_expr(p, 0)))
+				ast_add(n, e);
+			if(ast_at(p, 0xCB)) // THEN
 			{
-				if(bas->basic[i].tok[j].tok&0x80) // Keyword (or other high-bank token), pass thru untouched
-				{
-					append_char(&line, &ll, &li, bas->basic[i].tok[j].tok);
-					if(bas->basic[i].tok[j].tok==0xEA) // REM token, rest-of-line in token.data
-					{
-						if(bas->basic[i].tok[j].dl) // has embedded \0s (is an object file)
-						{
-							int ri;
-							for(ri=0;ri<bas->basic[i].tok[j].dl;ri++)
-								append_char(&line, &ll, &li, bas->basic[i].tok[j].data[ri]);
-						}
-						else
-						{
-							char *p=bas->basic[i].tok[j].data;
-							while(*p)
-							{
-								if((*p=='\\')&&(p[1]=='0')) // handle \\0 -> \0
-								{
-									append_char(&line, &ll, &li, 0);
-									p+=2;
-								}
-								else
-								{
-									append_char(&line, &ll, &li, *p++);
-								}
-							}
-						}
-					}
-				}
-				else
-				{
-					int k;
-					for(k=0;k<ntokens;k++)
-					{
-						char data[2]={bas->basic[i].tok[j].tok, 0};
-						if(strcasecmp(data, tokentable[k].text)==0)
-						{
-							append_char(&line, &ll, &li, bas->basic[i].tok[j].tok);
-							break;
-						}
-					}
-					if(k==ntokens)
-					{
-						switch(bas->basic[i].tok[j].tok)
-						{
-							case TOKEN_VAR: // fallthrough
-							case TOKEN_VARSTR:
-								append_str(&line, &ll, &li, bas->basic[i].tok[j].data);
-							break;
-							case TOKEN_ZXFLOAT:
-								append_str(&line, &ll, &li, bas->basic[i].tok[j].data);
-								append_char(&line, &ll, &li, TOKEN_ZXFLOAT);
-								int l;
-								for(l=0;l<5;l++)
-									append_char(&line, &ll, &li, bas->basic[i].tok[j].data2[l]);
-							break;
-							case TOKEN_STRING:
-								append_char(&line, &ll, &li, '"');
-								char *p=bas->basic[i].tok[j].data;
-								while(*p)
-								{
-									if((*p=='\\')&&(p[1]=='0')) // handle \\0 -> \0
-									{
-										append_char(&line, &ll, &li, 0);
-										p+=2;
-									}
-									else
-									{
-										append_char(&line, &ll, &li, *p++);
-									}
-								}
-								append_char(&line, &ll, &li, '"');
-							break;
-							case TOKEN_RLINK:
-								if(bas->basic[i].tok[j].data2)
-								{
-									if(write)
-									{
-										append_char(&line, &ll, &li, (signed char)0xEA);
-										int l;
-										for(l=0;l<((bin_seg *)bas->basic[i].tok[j].data2)->nbytes;l++)
-											append_char(&line, &ll, &li, ((bin_seg *)bas->basic[i].tok[j].data2)->bytes[l].byte);
-									}
-									else
-									{
-										append_char(&line, &ll, &li, TOKEN_RLINK);
-										int l;
-										for(l=0;l<((bin_seg *)bas->basic[i].tok[j].data2)->nbytes;l++)
-											append_char(&line, &ll, &li, 0);
-										((bin_seg *)bas->basic[i].tok[j].data2)->org=bas->basic[i].offset+1;
-									}
-								}
-							break;
-							case TOKEN_NONPRINT:
-								if(bas->basic[i].tok[j].data)
-								{
-									append_char(&line, &ll, &li, *bas->basic[i].tok[j].data);
+				ast_tok(n, p->tok[p->i++]);
+				ast_add(n, ast_block(p));
+			}
+		break;
+		case 0xF1: // LET var=expr
+		case 0xEB: // FOR var=expr TO expr [STEP expr]
+		case 0xCE: // DEF FN f(params)=expr
+			if((e=ast_operand(p))) // the variable being assigned to, not a comparison
+				ast_add(n, e);
+			if(ast_at(p, '='))
+				ast_tok(n, p->tok[p->i++]);
+		break;
+	}
+	while((p->i<p->ntok)&&!ast_at(p, ':')) // arguments and their separators
+	{
+		if((e=ast_expr(p, 0)))
+			ast_add(n, e);
+		else
+			ast_tok(n, p->tok[p->i++]);
+	}
+	return(n);
+}
+
+astnode *ast_block(astparser *p) // statements separated by ':', to the end of the line
+{
+	astnode *n=ast_new(AST_BLOCK, ':');
+	while(p->i<p->ntok)
+	{
+		if(ast_at(p, ':'))
+			ast_tok(n, p->tok[p->i++]);
+		else
+			ast_add(n, ast_stmt(p));
+	}
+	return(n);
+}
+
+astnode *ast_parse(basline *b) // parse a tokenised line; NULL if it has no tokens
+{
+	if(!b->ntok)
+		return(NULL);
+	astparser p={b->tok, b->ntok, 0};
+	astnode *n=ast_block(&p);
+	ast_size(n);
+	return(n);
+}
+
+int ast_size(astnode *n) // (re)compute the encoded sizes of n and its descendants
+{
+	int i;
+	n->size=0;
+	for(i=0;i<n->nitems;i++)
+		n->size+=n->items[i].node?ast_size(n->items[i].node):toksize(&n->items[i].tok);
+	return(n->size);
+}
+
+void ast_unparse(astnode *n, int *ntok, token **tok) // append n's tokens, in order, to the token list
+{
+	int i;
+	for(i=0;i<n->nitems;i++)
+	{
+		if(n->items[i].node)
+		{
+			ast_unparse(n->items[i].node, ntok, tok);
+		}
+		else
+		{
+			*tok=(token *)realloc(*tok, ++*ntok*sizeof(token));
+			(*tok)[*ntok-1]=n->items[i].tok;
+		}
+	}
+}
+
+void ast_toline(astnode *n, basline *b) // replace the line's tokens with the (possibly transformed) tree's
+{
+	free(b->tok);
+	b->tok=NULL;
+	b->ntok=0;
+	if(n)
+		ast_unparse(n, &b->ntok, &b->tok);
+}
+
+void ast_free(astnode *n) // the tokens' data are not freed, as the line may still share them
+{
+	if(!n) return;
+	int i;
+	for(i=0;i<n->nitems;i++)
+		ast_free(n->items[i].node);
+	free(n->items);
+	free(n);
+}
+
+int ast_prio(astnode *n) // how tightly the expression binds: as its operator, or 16 for operands and functions
+{
+	switch(n->type)
+	{
+		case AST_BINOP:
+			return(ast_binprio(n->op));
+		case AST_UNOP:
+			return((n->op==0xC3)?4:9);
+		default:
+			return(16);
+	}
+}
+
+astnode *ast_paren(astnode *n)
+{
+	astnode *p=ast_new(AST_PAREN, '(');
+	ast_tok(p, mktok('('));
+	ast_add(p, n);
+	ast_tok(p, mktok(')'));
+	p->str=n->str;
+	return(p);
+}
+
+astnode *ast_wrap(astnode *parent, int i, astnode *child) // child, bracketed if need be to stay where it is as parent's i'th item
+{
+	int prio=ast_prio(child);
+	bool need=false;
+	switch(parent->type)
+	{
+		case AST_BINOP: // operators of equal priority associate to the left
+			need=i?(prio<=ast_prio(parent)):(prio<ast_prio(parent));
+		break;
+		case AST_UNOP:
+			need=(child->type==AST_BINOP)&&(prio<=ast_prio(parent));
+		break;
+		case AST_FUNC:
+			need=(child->type==AST_BINOP);
+		break;
+		default:
+		break;
+	}
+	return(need?ast_paren(child):child);
+}
+
+astnode *ast_binop(astnode *lhs, unsigned char op, astnode *rhs) // the operands must already be bracketed as needed
+{
+	astnode *n=ast_new(AST_BINOP, op);
+	ast_add(n, lhs);
+	ast_tok(n, mktok(op));
+	ast_add(n, rhs);
+	return(n);
+}
+
+astnode *ast_func(unsigned char func, astnode *arg) // a function (or NOT), applied to arg if it isn't NULL
+{
+	astnode *n=ast_new((func==0xC3)?AST_UNOP:AST_FUNC, func);
+	ast_tok(n, mktok(func));
+	if(arg)
+		ast_add(n, arg);
+	return(n);
+}
+
+astnode *ast_copyvar(astnode *n) // another use of a variable
+{
+	astnode *c=ast_new(AST_VAR, n->op);
+	token t=n->items[0].tok;
+	t.data=strdup(t.data);
+	ast_tok(c, t);
+	c->str=n->str;
+	return(c);
+}
+
+void ast_dump(FILE *fp, astnode *n)
+{
+	static const char *types[]={"block", "stmt", "num", "str", "var", "label", "func", "fn", "unop", "binop", "paren", "index"};
+	fprintf(fp, "(%s", types[n->type]);
+	int i;
+	for(i=0;i<n->nitems;i++)
+	{
+		fputc(' ', fp);
+		if(n->items[i].node)
+		{
+			ast_dump(fp, n->items[i].node);
+			continue;
+		}
+		token *t=&n->items[i].tok;
+		const char *name;
+		switch(t->tok)
+		{
+			case TOKEN_VAR:
+			case TOKEN_VARSTR:
+			case TOKEN_ZXFLOAT:
+				fputs(t->data, fp);
+			break;
+			case TOKEN_STRING:
+				fprintf(fp, "\"%s\"", t->data);
+			break;
+			case TOKEN_LABEL:
+			case TOKEN_PTRLBL:
+				fprintf(fp, "%c%s", (t->tok==TOKEN_LABEL)?'%':'@', t->data);
+			break;
+			case TOKEN_RLINK:
+				fputs("!link", fp);
+			break;
+			case TOKEN_LOADER:
+				fputs("!load", fp);
+			break;
+			default:
+				if((name=tokname(t->tok)))
+					fputs(name, fp);
+				else
+					fprintf(fp, "\\%02X", t->tok);
+			break;
+		}
+	}
+	fprintf(fp, ":%u)", n->size);
+}
+
+double zxvalue(const char *buf) // the value of a ZX float, as the ROM sees it
+{
+	const unsigned char *b=(const unsigned char *)buf;
+	if(!b[0]) // small integer
+		return((b[2]|(b[3]<<8))-(b[1]?65536:0));
+	double m=(double)(((unsigned long)(b[1]|0x80)<<24)|(b[2]<<16)|(b[3]<<8)|b[4]);
+	return(ldexp((b[1]&0x80)?-m:m, b[0]-160));
+}
+
+bool zxfits(double value) // can be held in a ZX float without overflow or underflow (else the ROM reports 6 Number too big, or gets 0)
+{
+	return(isfinite(value)&&((value==0)||((fabs(value)<ldexp(1, 127)*(1-ldexp(1, -33)))&&(fabs(value)>=ldexp(1, -128)))));
+}
+
+double zxround(double value) // value rounded to the nearest ZX float (a 32-bit mantissa)
+{
+	int ex;
+	double m=frexp(value, &ex);
+	return(ldexp(nearbyint(ldexp(m, 32)), ex-32));
+}
+
+double zxdecfp(const char *text) // the number the ROM's DEC-TO-FP reads from text (NAN if it doesn't read all of it).  It works on the calculator a digit at a time, each step rounded, so it can differ from strtod() in the last bit
+{
+	double x=0, m=1;
+	const char *p=text;
+	for(;isdigit(*p);p++) // INT-TO-FP: x*10+d
+		x=zxround(zxround(x*10)+(*p-'0'));
+	if(*p=='.')
+	{
+		for(p++;isdigit(*p);p++) // each decimal is d times 1/10 of the last one's weight
+		{
+			m=zxround(m/10);
+			x=zxround(x+zxround((*p-'0')*m));
+		}
+	}
+	if((*p=='e')||(*p=='E'))
+	{
+		char *end;
+		long e=strtol(p+1, &end, 10), a=labs(e);
+		double ten=10;
+		p=end;
+		while(a) // E-TO-FP: multiply or divide by 10, 100, 10^4, 10^8... for each bit of the exponent
+		{
+			if(a&1)
+				x=zxround((e<0)?x/ten:x*ten);
+			a>>=1;
+			if(a)
+				ten=zxround(ten*ten);
+		}
+	}
+	return(*p?NAN:x);
+}
+
+bool zxreads(const char *text, double value, const char *as) // would bast read text back as the ZX float for value, and the ROM too (or at least as it reads the text as, if not NULL)?
+{
+	char want[5], got[5];
+	zxfloat(want, value);
+	zxfloat(got, strtod(text, NULL));
+	if(memcmp(want, got, 5))
+		return(false);
+	double x=zxdecfp(text);
+	return((x==zxvalue(want))||(as&&(x==zxdecfp(as))));
+}
+
+void zxtext(char *text, double value) // the shortest %g text for value which converts back to the same ZX float
+{
+	if((value==floor(value))&&(fabs(value)<1e10)) // whole numbers as they are: '20', not '2E+01'
+	{
+		sprintf(text, "%.0f", value);
+		return;
+	}
+	char want[5], got[5];
+	zxfloat(want, value);
+	int p;
+	for(p=1;p<=12;p++) // as the ROM reads it, if it can
+	{
+		sprintf(text, "%.*g", p, value);
+		if(zxreads(text, value, NULL))
+			break;
+	}
+	for(p=(p<=12)?13:1;p<=12;p++) // else as bast does
+	{
+		sprintf(text, "%.*g", p, value);
+		zxfloat(got, strtod(text, NULL));
+		if(!memcmp(want, got, 5))
+			break;
+	}
+	char *e=strchr(text, 'e');
+	if(e)
+		*e='E';
+}
+
+bool zxshort(char *text, double value, const char *as) // (text needs 32 bytes) the shortest text (leading '.', or exponent, as the ROM allows) for a non-negative value which zxreads() back; else false, with zxtext()'s text
+{
+	int p;
+	for(p=1;p<=12;p++) // fewest significant digits that either form reads back with
+	{
+		char digits[24], pos[32];
+		sprintf(digits, "%.*e", p-1, value);
+		char *e=strchr(digits, 'e');
+		int ex=atoi(e+1), n, l=0, i;
+		*e=0;
+		if(digits[1]=='.') // d.ddd -> dddd
+			memmove(digits+1, digits+2, strlen(digits+2)+1);
+		n=strlen(digits);
+		while((n>1)&&(digits[n-1]=='0')) // value is D.DDD * 10^ex
+			digits[--n]=0;
+		sprintf(text, "%sE%d", digits, ex-n+1); // DDDE<n>
+		bool eok=zxreads(text, value, as);
+		if((ex<-12)||(ex>12)) // positional would be longer
+		{
+			if(eok)
+				return(true);
+			continue;
+		}
+		if(ex<0) // .000DDD
+		{
+			pos[l++]='.';
+			for(i=-1;i>ex;i--)
+				pos[l++]='0';
+		}
+		for(i=0;i<n;i++)
+		{
+			if((ex>=0)&&(i==ex+1)) // DD.DD
+				pos[l++]='.';
+			pos[l++]=digits[i];
+		}
+		for(i=n;i<=ex;i++) // DDD000
+			pos[l++]='0';
+		pos[l]=0;
+		if(zxreads(pos, value, as)&&(!eok||(strlen(pos)<=strlen(text))))
+			strcpy(text, pos);
+		else if(!eok)
+			continue;
+		return(true);
+	}
+	zxtext(text, value);
+	return(false);
+}
+
+token mknum(double value) // a ZXFLOAT token for a (non-negative) value
+{
+	token t=mktok(TOKEN_ZXFLOAT);
+	t.data=(char *)malloc(32);
+	if(Oshortnumbers)
+		zxshort(t.data, value, NULL);
+	else
+		zxtext(t.data, value);
+	t.data2=(char *)malloc(5);
+	zxfloat(t.data2, value);
+	return(t);
+}
+
+token mktok(unsigned char tok)
+{
+	token t;
+	t.text=NULL;
+	t.tok=tok;
+	t.data=NULL;
+	t.dl=0;
+	t.data2=NULL;
+	t.index=0;
+	return(t);
+}
+
+bool isvalidlabel(char *text)
+{
+	if(!isalpha(*text))
+		return(false);
+	size_t s=strspn(text, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_");
+	return(!text[s]);
+}
+
+void addlabel(int *nlabels, label **labels, label lbl)
+{
+	int nl=(*nlabels)+1;
+	label *ll=(label *)realloc(*labels, nl*sizeof(label));
+	if(ll)
+	{
+		*nlabels=nl;
+		*labels=ll;
+		ll[nl-1]=lbl;
+	}
+}
+
+int mkoverlays(int *nsegs, segment **data, int seg, char **inbas) // split the lines after #pragma overlay into overlay segments following seg; returns nonzero on error
+{
+	bas_seg *bas=&(*data)[seg].data.bas;
+	int fbas=bas->fbas; // (bas moves when the overlays' segments are added)
+	if(!bas->renum)
+	{
+		fprintf(stderr, "bast: Overlays: %s: #pragma overlay needs #pragma renum\n", (*data)[seg].name);
+		return(1);
+	}
+	bas->blen=0;
+	buildbas(bas, false); // to measure the lines
+	if(bas->blen==-1)
+		return(1);
+	int first=bas->ovstart+1, j, k;
+	while((first<bas->nlines)&&!bas->basic[first].ntok&&(*bas->basic[first].text!='.'))
+		first++;
+	if((first==bas->nlines)||(*bas->basic[first].text!='.'))
+	{
+		fprintf(stderr, "bast: Overlays: %s: #pragma overlay must be followed by a .label\n", (*data)[seg].name);
+		return(1);
+	}
+	int *part=(int *)malloc(bas->nlines*sizeof(int)); // 0 for resident, else overlay number
+	int nov=0, size=0;
+	for(j=0;j<bas->nlines;j++)
+	{
+		if(j<first)
+		{
+			part[j]=0;
+			continue;
+		}
+		if(*bas->basic[j].text=='.') // overlays may only be split at labels
+		{
+			int group=0;
+			for(k=j;k<bas->nlines;k++)
+			{
+				if((k>j)&&(*bas->basic[k].text=='.')) break;
+				group+=((k+1<bas->nlines)?bas->basic[k+1].offset:bas->blen+4+bas->base)-bas->basic[k].offset;
+			}
+			if(group>bas->ovsize)
+				fprintf(stderr, "bast: Overlays: Warning: %s: code at label %s is %u bytes, more than the overlay size %u\n", (*data)[seg].name, bas->basic[j].text+1, group, bas->ovsize);
+			if(!nov||(size&&(size+group>bas->ovsize)))
+			{
+				nov++;
+				size=0;
+			}
+			size+=group;
+		}
+		part[j]=nov;
+	}
+	if(nov>99)
+	{
+		fprintf(stderr, "bast: Overlays: %s needs %u overlays (at most 99)\n", (*data)[seg].name, nov);
+		return(1);
+	}
+	// share out the lines, and chain each part to the next (which starts with a label) in case execution falls through
+	int *nlines=(int *)calloc(nov+1, sizeof(int));
+	basline **lines=(basline **)calloc(nov+1, sizeof(basline *));
+	for(j=0;j<bas->nlines;j++)
+	{
+		int p=part[j];
+		lines[p]=(basline *)realloc(lines[p], ++nlines[p]*sizeof(basline));
+		lines[p][nlines[p]-1]=bas->basic[j];
+		if((p<nov)&&((j+1==bas->nlines)||(part[j+1]!=p)))
+		{
+			char *label=bas->basic[j+1].text+1, goto_line[strlen(label)+8];
+			sprintf(goto_line, "GO TO %%%s", label);
+			addbasline(&nlines[p], &lines[p], goto_line);
+			tokenise(&lines[p][nlines[p]-1], inbas, fbas, 1);
+		}
+	}
+	free(bas->basic);
+	bas->basic=NULL;
+	bas->nlines=0;
+	// cross-overlay jumps go via a stub in the resident part, which MERGEs the overlay in
+	char name[16]; // 8 characters, 2 digits (and room for the sign gcc thinks p%100 might have)
+	int nstubs=0;
+	char **stubs=NULL; // target labels
+	int *stubov=NULL;
+	bool fail=false;
+	int p;
+	for(p=0;p<=nov;p++)
+	{
+		for(j=0;j<nlines[p];j++)
+		{
+			for(k=0;k<lines[p][j].ntok;k++)
+			{
+				token *t=&lines[p][j].tok[k];
+				if(((t->tok!=TOKEN_LABEL)&&(t->tok!=TOKEN_PTRLBL))||!t->data) continue;
+				int q,l;
+				for(q=1;q<=nov;q++)
+				{
+					for(l=0;l<nlines[q];l++)
+						if((*lines[q][l].text=='.')&&(strcmp(lines[q][l].text+1, t->data)==0)) break;
+					if(l<nlines[q]) break;
+				}
+				if((q>nov)||(q==p)) continue; // resident, same overlay, or in another segment
+				unsigned char prev=k?lines[p][j].tok[k-1].tok:0;
+				if((t->tok==TOKEN_PTRLBL)||!((prev==0xEC)||(prev==0xF7)||((prev==0xED)&&!p))) // GO TO, RUN, or GO SUB from the resident part
+				{
+					fprintf(stderr, "bast: Overlays: %s: reference to %c%s in another overlay must be GO TO or RUN (or GO SUB from the resident part)\n\t%s:%u\n", (*data)[seg].name, (t->tok==TOKEN_LABEL)?'%':'@', t->data, (*data)[seg].name, lines[p][j].sline);
+					fail=true;
+					continue;
+				}
+				for(l=0;l<nstubs;l++)
+					if(strcmp(stubs[l], t->data)==0) break;
+				if(l==nstubs)
+				{
+					stubs=(char **)realloc(stubs, ++nstubs*sizeof(char *));
+					stubov=(int *)realloc(stubov, nstubs*sizeof(int));
+					stubs[l]=t->data;
+					stubov[l]=q;
+				}
+				char *stub=(char *)malloc(strlen(t->data)+16);
+				sprintf(stub, "ov%u_%s", q, t->data);
+				t->data=stub;
+			}
+		}
+	}
+	if((bas->line<0)&&bas->lline)
+	{
+		for(j=0;j<nlines[0];j++)
+			if((*lines[0][j].text=='.')&&(strcmp(lines[0][j].text+1, bas->lline)==0)) break;
+		if(j==nlines[0])
+			for(p=1;p<=nov;p++)
+				for(k=0;k<nlines[p];k++)
+					if((*lines[p][k].text=='.')&&(strcmp(lines[p][k].text+1, bas->lline)==0))
+					{
+						fprintf(stderr, "bast: Overlays: %s: #pragma line %s must be in the resident part\n", (*data)[seg].name, bas->lline);
+						fail=true;
+					}
+	}
+	for(j=0;j<nstubs;j++)
+	{
+		char *stub=(char *)malloc(2*strlen(stubs[j])+40);
+		sprintf(stub, ".ov%u_%s", stubov[j], stubs[j]);
+		addbasline(&nlines[0], &lines[0], stub);
+		snprintf(name, sizeof(name), "%.8s%02u", (*data)[seg].name, stubov[j]%100);
+		sprintf(stub, "MERGE \"%s\": GO TO %%%s", name, stubs[j]);
+		addbasline(&nlines[0], &lines[0], stub);
+		tokenise(&lines[0][nlines[0]-1], inbas, fbas, 1);
+		free(stub);
+	}
+	free(stubs);
+	free(stubov);
+	free(part);
+	if(fail||err)
+		return(1);
+	// every overlay has the same line numbers, so that MERGE replaces all of the previous one
+	int *blines=(int *)calloc(nov+1, sizeof(int)), most=0;
+	for(p=0;p<=nov;p++)
+	{
+		for(j=0;j<nlines[p];j++)
+			if(lines[p][j].ntok) blines[p]++;
+		if(p) most=max(most, blines[p]);
+	}
+	int dnum=bas->rnoffset?bas->rnoffset:10, end=bas->rnend?bas->rnend:9999, start;
+	while(true)
+	{
+		start=bas->rnstart?bas->rnstart:dnum;
+		if(start+(blines[0]+most-1)*dnum<=end) break;
+		dnum--;
+		if((dnum==7)||(dnum==9))
+			dnum--;
+		if(dnum<=0)
+		{
+			fprintf(stderr, "bast: Overlays: Couldn't fit %s into available lines\n", (*data)[seg].name);
+			return(1);
+		}
+	}
+	bas->basic=lines[0];
+	bas->nlines=nlines[0];
+	bas->blines=blines[0];
+	bas->rnstart=start;
+	bas->rnoffset=dnum;
+	bas->rnend=end;
+	int at=seg+1;
+	while((at<*nsegs)&&((*data)[at].type==BINARY)) // after the resident part's CODE, so !load still finds it
+		at++;
+	for(p=1;p<=nov;p++)
+	{
+		while(blines[p]<most)
+		{
+			addbasline(&nlines[p], &lines[p], "REM");
+			tokenise(&lines[p][nlines[p]-1], inbas, fbas, 1);
+			blines[p]++;
+		}
+		if(!addsegment(nsegs, data))
+		{
+			fprintf(stderr, "bast: Internal error: failed to add overlay segment\n");
+			return(1);
+		}
+		memmove(*data+at+1, *data+at, (*nsegs-at-1)*sizeof(segment));
+		segment *ov=*data+at++;
+		snprintf(name, sizeof(name), "%.8s%02u", (*data)[seg].name, p%100);
+		ov->name=strdup(name);
+		ov->type=BASIC;
+		bas_seg *ob=&ov->data.bas;
+		ob->nlines=nlines[p];
+		ob->basic=lines[p];
+		ob->blines=blines[p];
+		ob->line=0;
+		ob->lline=NULL;
+		ob->renum=1;
+		ob->rnstart=start+blines[0]*dnum;
+		ob->rnoffset=dnum;
+		ob->rnend=end;
+		ob->block=NULL;
+		ob->vars=NULL;
+		ob->vlen=0;
+		ob->base=0x5CCB;
+		ob->ovstart=-1;
+		ob->ovsize=0;
+		ob->ovparent=seg;
+		ob->fbas=fbas;
+		fprintf(stderr, "bast: Overlays: %s has lines %u-%u\n", ov->name, ob->rnstart, ob->rnstart+(most-1)*dnum);
+	}
+	fprintf(stderr, "bast: Overlays: split %s into a resident part (%u lines) and %u overlays\n", (*data)[seg].name, blines[0], nov);
+	free(blines);
+	free(nlines);
+	free(lines);
+	return(0);
+}
+
+int addvar(bas_seg *bas, char *decl) // encode a #vars declaration into bas->vars, in the Spectrum's VARS format; returns nonzero on error
+{
+	int dl=bas->vlen+1;
+	if(!bas->vars)
+		init_char(&bas->vars, &dl, &bas->vlen);
+	while(isspace(*decl)) decl++;
+	bool dim=(strncasecmp(decl, "DIM", 3)==0)&&!isalnum(decl[3]);
+	if(dim)
+	{
+		decl+=3;
+		while(isspace(*decl)) decl++;
+	}
+	if(!isalpha(*decl))
+	{
+		fprintf(stderr, "bast: #vars: bad variable name in %s\n", decl);
+		return(1);
+	}
+	char name[64];
+	int nl=0;
+	while((isalnum(*decl)||(*decl==' '))&&(nl<63)) // the Spectrum ignores spaces in names
+	{
+		if(*decl!=' ')
+			name[nl++]=tolower(*decl);
+		decl++;
+	}
+	name[nl]=0;
+	bool str=(*decl=='$');
+	if(str) decl++;
+	if((str||dim)&&(nl>1))
+	{
+		fprintf(stderr, "bast: #vars: %s%s must be a single letter\n", name, str?"$":"");
+		return(1);
+	}
+	while(isspace(*decl)) decl++;
+	int ndims=0, dims[255], nel=1;
+	if(dim)
+	{
+		if(*decl++!='(')
+		{
+			fprintf(stderr, "bast: #vars: DIM %s%s missing dimensions\n", name, str?"$":"");
+			return(1);
+		}
+		while(ndims<255)
+		{
+			char *end;
+			long d=strtol(decl, &end, 10);
+			if((end==decl)||(d<1)||(d>0xFFFF))
+			{
+				fprintf(stderr, "bast: #vars: DIM %s%s bad dimension %s\n", name, str?"$":"", decl);
+				return(1);
+			}
+			dims[ndims++]=d;
+			nel*=d;
+			if(nel>0xFFFF)
+			{
+				fprintf(stderr, "bast: #vars: DIM %s%s is too big\n", name, str?"$":"");
+				return(1);
+			}
+			decl=end;
+			while(isspace(*decl)) decl++;
+			if(*decl==')') break;
+			if(*decl++!=',')
+			{
+				fprintf(stderr, "bast: #vars: DIM %s%s bad dimensions\n", name, str?"$":"");
+				return(1);
+			}
+		}
+		decl++;
+		while(isspace(*decl)) decl++;
+	}
+	int nvals=0;
+	double *nums=NULL;
+	char **strs=NULL;
+	if(*decl=='=')
+	{
+		decl++;
+		while(true)
+		{
+			while(isspace(*decl)) decl++;
+			if(str)
+			{
+				if(*decl!='"')
+				{
+					fprintf(stderr, "bast: #vars: %s$ bad string %s\n", name, decl);
+					return(1);
+				}
+				char *s=(char *)malloc(strlen(decl));
+				int sl=0;
+				decl++;
+				while(*decl&&!((*decl=='"')&&(decl[1]!='"')))
+				{
+					if(*decl=='"') decl++; // "" is a quote mark, as in BASIC
+					s[sl++]=*decl++;
+				}
+				if(*decl++!='"')
+				{
+					fprintf(stderr, "bast: #vars: %s$ unterminated string\n", name);
+					return(1);
+				}
+				s[sl]=0;
+				strs=(char **)realloc(strs, ++nvals*sizeof(char *));
+				strs[nvals-1]=s;
+			}
+			else
+			{
+				char *end;
+				double v=strtod(decl, &end);
+				if(end==decl)
+				{
+					fprintf(stderr, "bast: #vars: %s bad number %s\n", name, decl);
+					return(1);
+				}
+				nums=(double *)realloc(nums, ++nvals*sizeof(double));
+				nums[nvals-1]=v;
+				decl=end;
+			}
+			while(isspace(*decl)) decl++;
+			if(*decl!=',') break;
+			decl++;
+		}
+	}
+	if(*decl)
+	{
+		fprintf(stderr, "bast: #vars: %s%s: junk at end of declaration: %s\n", name, str?"$":"", decl);
+		return(1);
+	}
+	int rows=dim?(str?nel/dims[ndims-1]:nel):1;
+	if((nvals>rows)||(!dim&&!nvals))
+	{
+		fprintf(stderr, "bast: #vars: %s%s: %s values\n", name, str?"$":"", nvals?"too many":"missing");
+		return(1);
+	}
+	char fl[5];
+	int i,j;
+	if(!dim&&!str) // number: 011xxxxx, or 101xxxxx ... 1xxxxxxx for a long name; then the value
+	{
+		if(nl==1)
+		{
+			append_char(&bas->vars, &dl, &bas->vlen, 0x60|(name[0]&0x1F));
+		}
+		else
+		{
+			append_char(&bas->vars, &dl, &bas->vlen, 0xA0|(name[0]&0x1F));
+			for(i=1;i<nl-1;i++)
+				append_char(&bas->vars, &dl, &bas->vlen, name[i]);
+			append_char(&bas->vars, &dl, &bas->vlen, name[nl-1]|0x80);
+		}
+		zxfloat(fl, nums[0]);
+		for(i=0;i<5;i++)
+			append_char(&bas->vars, &dl, &bas->vlen, fl[i]);
+	}
+	else if(!dim) // string: 010xxxxx, length, text
+	{
+		int sl=strlen(strs[0]);
+		append_char(&bas->vars, &dl, &bas->vlen, 0x40|(name[0]&0x1F));
+		append_char(&bas->vars, &dl, &bas->vlen, sl);
+		append_char(&bas->vars, &dl, &bas->vlen, sl>>8);
+		append_str(&bas->vars, &dl, &bas->vlen, strs[0]);
+	}
+	else // array: 100xxxxx (numbers) or 110xxxxx (characters), length, dimensions, then the elements with the last subscript varying fastest
+	{
+		int len=1+2*ndims+nel*(str?1:5);
+		if(len>0xFFFF)
+		{
+			fprintf(stderr, "bast: #vars: DIM %s%s is too big\n", name, str?"$":"");
+			return(1);
+		}
+		append_char(&bas->vars, &dl, &bas->vlen, (str?0xC0:0x80)|(name[0]&0x1F));
+		append_char(&bas->vars, &dl, &bas->vlen, len);
+		append_char(&bas->vars, &dl, &bas->vlen, len>>8);
+		append_char(&bas->vars, &dl, &bas->vlen, ndims);
+		for(i=0;i<ndims;i++)
+		{
+			append_char(&bas->vars, &dl, &bas->vlen, dims[i]);
+			append_char(&bas->vars, &dl, &bas->vlen, dims[i]>>8);
+		}
+		for(i=0;i<rows;i++)
+		{
+			if(str) // each value fills a row, padded with spaces
+			{
+				char *s=(i<nvals)?strs[i]:"";
+				for(j=0;j<dims[ndims-1];j++)
+					append_char(&bas->vars, &dl, &bas->vlen, *s?*s++:' ');
+			}
+			else
+			{
+				zxfloat(fl, (i<nvals)?nums[i]:0);
+				for(j=0;j<5;j++)
+					append_char(&bas->vars, &dl, &bas->vlen, fl[j]);
+			}
+		}
+	}
+	for(i=0;i<(str?nvals:0);i++)
+		free(strs[i]);
+	free(strs);
+	free(nums);
+	return(0);
+}
+
+void buildbas(bas_seg *bas, bool write) // if write is false, we just compute offsets
+{
+	int dbl;
+	if(write)
+	{
+		init_char(&bas->block, &dbl, &bas->blen);
+	}
+	else
+	{
+		bas->block=NULL;
+	}
+	int i;
+	for(i=0;i<bas->nlines;i++) // Address of first line's number MSB is base (0x5CCB).  Text starts 4 bytes later
+	{
+		bas->basic[i].offset=bas->blen+4+bas->base;
+		if(bas->basic[i].ntok)
+		{
+			append_char(&bas->block, &dbl, &bas->blen, bas->basic[i].number>>8); // MSB first!!!!
+			append_char(&bas->block, &dbl, &bas->blen, bas->basic[i].number);
+			char *line;
+			int li,ll;
+			init_char(&line, &ll, &li);
+			int j;
+			for(j=0;j<bas->basic[i].ntok;j++)
+			{
+				if(bas->basic[i].tok[j].tok&0x80) // Keyword (or other high-bank token), pass thru untouched
+				{
+					append_char(&line, &ll, &li, bas->basic[i].tok[j].tok);
+					if(bas->basic[i].tok[j].tok==0xEA) // REM token, rest-of-line in token.data
+					{
+						if(bas->basic[i].tok[j].dl) // has embedded \0s (is an object file)
+						{
+							int ri;
+							for(ri=0;ri<bas->basic[i].tok[j].dl;ri++)
+								append_char(&line, &ll, &li, bas->basic[i].tok[j].data[ri]);
+						}
+						else
+						{
+							char *p=bas->basic[i].tok[j].data;
+							while(*p)
+							{
+								if((*p=='\\')&&(p[1]=='0')) // handle \\0 -> \0
+								{
+									append_char(&line, &ll, &li, 0);
+									p+=2;
+								}
+								else
+								{
+									append_char(&line, &ll, &li, *p++);
+								}
+							}
+						}
+					}
+				}
+				else
+				{
+					int k;
+					for(k=0;k<ntokens;k++)
+					{
+						char data[2]={bas->basic[i].tok[j].tok, 0};
+						if(strcasecmp(data, tokentable[k].text)==0)
+						{
+							append_char(&line, &ll, &li, bas->basic[i].tok[j].tok);
+							break;
+						}
+					}
+					if(k==ntokens)
+					{
+						switch(bas->basic[i].tok[j].tok)
+						{
+							case TOKEN_VAR: // fallthrough
+							case TOKEN_VARSTR:
+								append_str(&line, &ll, &li, bas->basic[i].tok[j].data);
+							break;
+							case TOKEN_ZXFLOAT: // the text is only for listings, so -O cut-numbers replaces it with '.'
+								append_str(&line, &ll, &li, Ocutnumbers?".":bas->basic[i].tok[j].data);
+								append_char(&line, &ll, &li, TOKEN_ZXFLOAT);
+								int l;
+								for(l=0;l<5;l++)
+									append_char(&line, &ll, &li, bas->basic[i].tok[j].data2[l]);
+							break;
+							case TOKEN_STRING:
+								append_char(&line, &ll, &li, '"');
+								char *p=bas->basic[i].tok[j].data;
+								while(*p)
+								{
+									if((*p=='\\')&&(p[1]=='0')) // handle \\0 -> \0
+									{
+										append_char(&line, &ll, &li, 0);
+										p+=2;
+									}
+									else
+									{
+										append_char(&line, &ll, &li, *p++);
+									}
+								}
+								append_char(&line, &ll, &li, '"');
+							break;
+							case TOKEN_RLINK:
+								if(bas->basic[i].tok[j].data2)
+								{
+									if(write)
+									{
+										append_char(&line, &ll, &li, (signed char)0xEA);
+										int l;
+										for(l=0;l<((bin_seg *)bas->basic[i].tok[j].data2)->nbytes;l++)
+											append_char(&line, &ll, &li, ((bin_seg *)bas->basic[i].tok[j].data2)->bytes[l].byte);
+									}
+									else
+									{
+										append_char(&line, &ll, &li, TOKEN_RLINK);
+										int l;
+										for(l=0;l<((bin_seg *)bas->basic[i].tok[j].data2)->nbytes;l++)
+											append_char(&line, &ll, &li, 0);
+										((bin_seg *)bas->basic[i].tok[j].data2)->org=bas->basic[i].offset+1;
+									}
+								}
+							break;
+							case TOKEN_LOADER:
+								if(bas->basic[i].tok[j].data2)
+								{
+									loadinfo *ld=(loadinfo *)bas->basic[i].tok[j].data2;
+									int l;
+									if(ld->mc) // headerless: RANDOMIZE USR addr:REM loader
+									{
+										unsigned int addr=bas->basic[i].offset+li+(Ocutnumbers?1:5)+10; // RANDOMIZE USR, number, 0x0E+5, ':' REM
+										append_char(&line, &ll, &li, (signed char)0xF9);
+										append_char(&line, &ll, &li, (signed char)0xC0);
+										append_num(&line, &ll, &li, addr, 5);
+										append_char(&line, &ll, &li, ':');
+										append_char(&line, &ll, &li, (signed char)0xEA);
+										ld->mc->org=addr;
+										unsigned int tbl=addr+ld->mc->bytes[1].byte+(ld->mc->bytes[2].byte<<8); // LD HL,table is relative to the start of the loader
+										append_char(&line, &ll, &li, ld->mc->bytes[0].byte);
+										append_char(&line, &ll, &li, tbl);
+										append_char(&line, &ll, &li, tbl>>8);
+										for(l=3;l<ld->mc->nbytes;l++)
+											append_char(&line, &ll, &li, ld->mc->bytes[l].byte);
+									}
+									else // LOAD "" CODE for each block (or LOAD "<file>" CODE, on disk), paging in its bank first
+									{
+										int cur=0; // bank paged in at 0xC000
+										for(l=0;l<=ld->nblocks;l++)
+										{
+											int bank=(l<ld->nblocks)?max(ld->blocks[l].bank, 0):0; // unbanked CODE, and BASIC afterwards, want bank 0
+											if(l&&((l<ld->nblocks)||(bank!=cur)))
+												append_char(&line, &ll, &li, ':');
+											if(bank!=cur) // POKE BANKM,16+bank:OUT 32765,16+bank
+											{
+												append_char(&line, &ll, &li, (signed char)0xF4);
+												append_num(&line, &ll, &li, 23388, 0);
+												append_char(&line, &ll, &li, ',');
+												append_num(&line, &ll, &li, 16+bank, 0);
+												append_char(&line, &ll, &li, ':');
+												append_char(&line, &ll, &li, (signed char)0xDF);
+												append_num(&line, &ll, &li, 32765, 0);
+												append_char(&line, &ll, &li, ',');
+												append_num(&line, &ll, &li, 16+bank, 0);
+												if(l<ld->nblocks)
+													append_char(&line, &ll, &li, ':');
+												cur=bank;
+											}
+											if(l<ld->nblocks)
+											{
+												append_char(&line, &ll, &li, (signed char)0xEF);
+												append_char(&line, &ll, &li, '"');
+												append_str(&line, &ll, &li, ld->blocks[l].name);
+												append_char(&line, &ll, &li, '"');
+												append_char(&line, &ll, &li, (signed char)0xAF);
+											}
+										}
+									}
+								}
+							break;
+							case TOKEN_NONPRINT:
+								if(bas->basic[i].tok[j].data)
+								{
+									append_char(&line, &ll, &li, *bas->basic[i].tok[j].data);
 								}
 							break;
 							case TOKEN_PTRLBL:
@@ -1710,180 +3870,3193 @@ void buildbas(bas_seg *bas, bool write) // if write is false, we just compute of
 									}
 								}
 							break;
-							case TOKEN_LABEL:
-								if(bas->basic[i].tok[j].data)
+							case TOKEN_LABEL:
+								if(bas->basic[i].tok[j].data)
+								{
+									if(write)
+									{
+										fprintf(stderr, "bast: buildbas: Internal error: TOKEN_LABEL in second pass\n");
+										bas->blen=-1;
+										goto exit;
+									}
+									else
+									{
+										append_char(&line, &ll, &li, TOKEN_LABEL);
+										int l;
+										for(l=0;l<(Ocutnumbers?6:(bas->basic[i].tok[j].dl?bas->basic[i].tok[j].dl:5)+5);l++)
+											append_char(&line, &ll, &li, 0);
+									}
+								}
+							break;
+							default:
+								fprintf(stderr, "bast: buildbas: Internal error: Bad token 0x%02X\n", bas->basic[i].tok[j].tok);
+								bas->blen=-1;
+								goto exit;
+							break;
+						}
+					}
+				}
+			}
+			append_char(&line, &ll, &li, 0x0D); // 0x0D is ENTER in ZX charset
+			append_char(&bas->block, &dbl, &bas->blen, li);
+			append_char(&bas->block, &dbl, &bas->blen, li>>8);
+			for(j=0;j<li;j++)
+				append_char(&bas->block, &dbl, &bas->blen, line[j]);
+			free(line);
+		}
+	}
+	exit:;
+}
+
+void bin_load(char *fname, FILE *fp, bin_seg * buf, char **name)
+{
+	bool warned=false;
+	if(buf)
+	{
+		buf->nbytes=0;
+		buf->bytes=NULL;
+		buf->org=-1;
+		buf->bank=-1;
+		buf->packed=NULL;
+		buf->plen=0;
+		fprintf(stderr, "bast: Linker (object): reading %s\n", fname);
+		char *line=fgetl(fp);
+		int len=0;
+		int i=1;
+		while(line&&!feof(fp))
+		{
+			if(*line)
+			{
+				if(*line=='@')
+				{
+					sscanf(line, "@%04x/%d", (unsigned int *)&buf->org, &buf->bank);
+				}
+				else if(strncmp(line, "#pragma bank ", 13)==0)
+				{
+					sscanf(line+13, "%d", &buf->bank);
+				}
+				else if(*line=='#')
+				{
+					if(name)
+						*name=strdup(line+1);
+				}
+				else if(*line=='*')
+				{
+					sscanf(line, "*%04x", (unsigned int *)&len);
+				}
+				else
+				{
+					unsigned char cksum=0;
+					char *ent=strtok(line, " \t");
+					bin_byte row[8];
+					int col;
+					for(col=0;col<8;col++)
+					{
+						if(!ent)
+						{
+							fprintf(stderr, "bast: Linker (object): Too few pairs on line\n\t%s:%u\n", fname, i);
+							err=true;
+							break;
+						}
+						if(isxdigit(ent[0])&&isxdigit(ent[1]))
+						{
+							unsigned int n;
+							sscanf(ent, "%02x", &n);
+							row[col].type=BYTE;
+							row[col].byte=n;
+							cksum^=n;
+						}
+						else if((ent[0]=='$')&&(ent[1]=='$'))
+						{
+							if((!len)||(buf->nbytes+col+1>=len))
+							{
+								row[col].type=BNONE;
+								row[col].byte=0;
+							}
+							else
+							{
+								fprintf(stderr, "bast: Linker (object): Bad pair %s (too soon)\n\t%s:%u\n", ent, fname, i);
+								err=true;
+							}
+						}
+						else
+						{
+							fprintf(stderr, "bast: Linker (object): Bad pair %s\n\t%s:%u\n", ent, fname, i);
+							err=true;
+						}
+						ent=strtok(NULL, " \t");
+					}
+					if(ent)
+					{
+						if((ent[0]=='=')&&(ent[1]=='='))
+						{
+							ent=strtok(NULL, "");
+							if(ent&&isxdigit(ent[0])&&isxdigit(ent[1]))
+							{
+								unsigned int n;
+								sscanf(ent, "%02x", &n);
+								if(cksum!=n)
 								{
-									if(write)
-									{
-										fprintf(stderr, "bast: buildbas: Internal error: TOKEN_LABEL in second pass\n");
-										bas->blen=-1;
-										goto exit;
-									}
-									else
-									{
-										append_char(&line, &ll, &li, TOKEN_LABEL);
-										int l;
-										for(l=0;l<(Ocutnumbers?6:10);l++)
-											append_char(&line, &ll, &li, 0);
-									}
+									fprintf(stderr, "bast: Linker (object): Checksum failed: got %02x, expected %02x\n\t%s:%u\n", n, cksum, fname, i);
+									err=true;
 								}
-							break;
-							default:
-								fprintf(stderr, "bast: buildbas: Internal error: Bad token 0x%02X\n", bas->basic[i].tok[j].tok);
-								bas->blen=-1;
-								goto exit;
-							break;
+							}
+							else
+							{
+								fprintf(stderr, "bast: Linker (object): Bad pair (checksum) %s\n\t%s:%u\n", ent, fname, i);
+								err=true;
+							}
+						}
+						else
+						{
+							fprintf(stderr, "bast: Linker (object): Bad pair (==) %s\n\t%s:%u\n", ent, fname, i);
+							err=true;
 						}
 					}
+					else if(Wobjsum&&!warned)
+					{
+						fprintf(stderr, "bast: Linker (object): Warning, checksum missing\n\t%s:%u\n", fname, i);
+						warned=true;
+					}
+					if(!err)
+					{
+						col=0;
+						while((col<8) && row[col].type!=BNONE)
+						{
+							buf->nbytes++;
+							buf->bytes=(bin_byte *)realloc(buf->bytes, buf->nbytes*sizeof(bin_byte));
+							buf->bytes[buf->nbytes-1]=row[col++];
+						}
+					}
+				}
+			}
+			free(line);
+			line=err?NULL:fgetl(fp);
+			i++;
+		}
+		fclose(fp);
+		if(len && (len!=buf->nbytes))
+		{
+			fprintf(stderr, "bast: Linker (object): %s got bad count %u bytes of %u\n", fname, buf->nbytes, len);
+			err=true;
+		}
+		else if(!len && Wobjlen)
+		{
+			fprintf(stderr, "bast: Linker (object): Warning, no length directive in %s\n", fname);
+		}
+		else
+		{
+			fprintf(stderr, "bast: Linker (object): %s got %u bytes\n", fname, buf->nbytes);
+		}
+	}
+	else
+	{
+		fprintf(stderr, "bast: Linker (object): Internal error: %s no buffer to write!\n", fname);
+		err=true;
+	}
+}
+
+/* Headerless loader: loads each (length, address) pair from the table with the ROM's LD-BYTES, until a zero length
+	LD HL,table; loop: LD E,(HL); INC HL; LD D,(HL); INC HL; LD A,D; OR E; RET Z; LD C,(HL); INC HL; LD B,(HL); INC HL
+	PUSH HL; PUSH BC; POP IX; LD A,0xFF; SCF; CALL LD-BYTES; POP HL; JR C,loop; RST 8; DEFB 0x1A (R Tape loading error)
+*/
+const unsigned char loader_code[LOADER_TABLE]={0x21, LOADER_TABLE, 0x00, 0x5E, 0x23, 0x56, 0x23, 0x7A, 0xB3, 0xC8, 0x4E, 0x23, 0x46, 0x23, 0xE5, 0xC5, 0xDD, 0xE1, 0x3E, 0xFF, 0x37, 0xCD, 0x56, 0x05, 0xE1, 0x38, 0xE8, 0xCF, 0x1A};
+
+/* Full headerless loader: as above, but also pages each block's 128K RAM bank in at 0xC000 (keeping BANKM up to date) and depacks packed blocks in place
+	Each table entry is (length, address, bank, depack address (0 if the block is not packed)); bank 0 is paged back in at the end, even on error
+	Packed format: a control byte c; c==0 ends the stream, c<0x80 is followed by c literal bytes, c>=0x80 is a match of (c&0x7F)+3 bytes copied from (LE word) offset bytes back in the output
+*/
+const unsigned char full_loader_code[FULL_TABLE]={
+	0x21, FULL_TABLE, 0x00,	// LD HL,table
+	0x5E, 0x23, 0x56, 0x23, 0x7A, 0xB3, 0x28, 0x57, // loop: LD E,(HL); INC HL; LD D,(HL); INC HL; LD A,D; OR E; JR Z,finish
+	0x4E, 0x23, 0x46, 0x23, 0xE5, 0xC5, 0xC5, 0x4E, // LD C,(HL); INC HL; LD B,(HL); INC HL; PUSH HL; PUSH BC; PUSH BC; LD C,(HL)
+	0x3A, 0x5C, 0x5B, 0xE6, 0xF8, 0xB1, 0x32, 0x5C, 0x5B, 0x01, 0xFD, 0x7F, 0xED, 0x79, // LD A,(BANKM); AND 0xF8; OR C; LD (BANKM),A; LD BC,0x7FFD; OUT (C),A
+	0xDD, 0xE1, 0x3E, 0xFF, 0x37, 0xCD, 0x56, 0x05, 0xC1, 0xE1, 0x30, 0x36, // POP IX; LD A,0xFF; SCF; CALL LD-BYTES; POP BC; POP HL; JR NC,error
+	0x23, 0x5E, 0x23, 0x56, 0x23, 0x7A, 0xB3, 0x28, 0xCD, // INC HL; LD E,(HL); INC HL; LD D,(HL); INC HL; LD A,D; OR E; JR Z,loop
+	0xE5, 0x60, 0x69, // PUSH HL; LD H,B; LD L,C
+	0x7E, 0x23, 0xB7, 0x28, 0x21, 0x06, 0x00, 0xCB, 0x7F, 0x20, 0x05, // depack: LD A,(HL); INC HL; OR A; JR Z,done; LD B,0; BIT 7,A; JR NZ,match
+	0x4F, 0xED, 0xB0, 0x18, 0xF0, // LD C,A; LDIR; JR depack
+	0xE6, 0x7F, 0xC6, 0x03, 0x4F, 0x7E, 0x23, 0xE5, 0x66, 0x6F, // match: AND 0x7F; ADD A,3; LD C,A; LD A,(HL); INC HL; PUSH HL; LD H,(HL); LD L,A
+	0xD5, 0xEB, 0xA7, 0xED, 0x52, 0xD1, 0xED, 0xB0, 0xE1, 0x23, 0x18, 0xDA, // PUSH DE; EX DE,HL; AND A; SBC HL,DE; POP DE; LDIR; POP HL; INC HL; JR depack
+	0xE1, 0x18, 0xA1, // done: POP HL; JR loop
+	0x37, // finish: SCF
+	0xF5, 0x3A, 0x5C, 0x5B, 0xE6, 0xF8, 0x32, 0x5C, 0x5B, 0x01, 0xFD, 0x7F, 0xED, 0x79, // error: PUSH AF; LD A,(BANKM); AND 0xF8; LD (BANKM),A; LD BC,0x7FFD; OUT (C),A
+	0xF1, 0xD8, 0xCF, 0x1A // POP AF; RET C; RST 8; DEFB 0x1A (R Tape loading error)
+};
+
+loadinfo *mkloader(segment *data, int nsegs, int seg, bool disk, bool headerless)
+{
+	loadinfo *rv=(loadinfo *)malloc(sizeof(loadinfo));
+	rv->nblocks=0;
+	rv->blocks=NULL;
+	rv->mc=NULL;
+	bool full=false;
+	int j;
+	for(j=seg+1;(j<nsegs)&&(data[j].type==BINARY);j++)
+	{
+		rv->blocks=(ldblock *)realloc(rv->blocks, ++rv->nblocks*sizeof(ldblock));
+		rv->blocks[rv->nblocks-1].bank=data[j].data.bin.bank;
+		if(disk)
+			dskname(rv->blocks[rv->nblocks-1].name, data[j].name, true);
+		else
+			rv->blocks[rv->nblocks-1].name[0]=0;
+		if(data[j].data.bin.packed||(data[j].data.bin.bank>=0))
+			full=true;
+	}
+	if(!headerless||disk)
+		return(rv);
+	const unsigned char *code=full?full_loader_code:loader_code;
+	int tbl=full?FULL_TABLE:LOADER_TABLE, ent=full?7:4;
+	bin_seg *mc=rv->mc=(bin_seg *)malloc(sizeof(bin_seg));
+	mc->org=0; // filled in by buildbas()
+	mc->bank=-1;
+	mc->packed=NULL;
+	mc->nbytes=tbl+rv->nblocks*ent+2;
+	mc->bytes=(bin_byte *)malloc(mc->nbytes*sizeof(bin_byte));
+	int i;
+	for(i=0;i<mc->nbytes;i++)
+	{
+		mc->bytes[i].type=BYTE;
+		mc->bytes[i].byte=(i<tbl)?code[i]:0;
+	}
+	for(j=0;j<rv->nblocks;j++)
+	{
+		bin_seg *b=&data[seg+1+j].data.bin;
+		bin_byte *e=mc->bytes+tbl+j*ent;
+		e[0].byte=b->packed?b->plen:b->nbytes;
+		e[1].byte=(b->packed?b->plen:b->nbytes)>>8;
+		e[2].byte=b->packed?b->porg:b->org;
+		e[3].byte=(b->packed?b->porg:b->org)>>8;
+		if(full)
+		{
+			e[4].byte=max(b->bank, 0);
+			e[5].byte=b->packed?b->org:0;
+			e[6].byte=b->packed?b->org>>8:0;
+		}
+	}
+	return(rv);
+}
+
+int pack(const unsigned char *src, int len, unsigned char **dst, int *margin) // returns length of packed data, or -1
+{
+	// greedy LZ with hash chains on 3-byte prefixes.  *margin is how far the packed data must overhang the end of the output to depack in place
+	int *head=(int *)malloc(4096*sizeof(int)), *prev=(int *)malloc(max(len, 1)*sizeof(int));
+	unsigned char *out=(unsigned char *)malloc(len+len/127+2);
+	if(!(head&&prev&&out))
+	{
+		free(head);
+		free(prev);
+		free(out);
+		return(-1);
+	}
+	int i, o=0, lit=-1; // lit is the position of the current literal run's control byte, or -1
+	for(i=0;i<4096;i++)
+		head[i]=-1;
+	for(i=0;i<len;)
+	{
+		int bl=0, bo=0;
+		if(i+3<=len)
+		{
+			int h=((src[i]<<4)^(src[i+1]<<2)^src[i+2])&0xFFF;
+			int c=head[h], depth=256;
+			while((c>=0)&&(i-c<=0xFFFF)&&depth--)
+			{
+				int l=0;
+				while((i+l<len)&&(l<130)&&(src[c+l]==src[i+l]))
+					l++;
+				if(l>bl)
+				{
+					bl=l;
+					bo=i-c;
+				}
+				c=prev[c];
+			}
+		}
+		int n=(bl>=4)?bl:1, k;
+		for(k=0;(k<n)&&(i+k+3<=len);k++)
+		{
+			int h=((src[i+k]<<4)^(src[i+k+1]<<2)^src[i+k+2])&0xFFF;
+			prev[i+k]=head[h];
+			head[h]=i+k;
+		}
+		if(bl>=4)
+		{
+			out[o++]=0x80|(bl-3);
+			out[o++]=bo;
+			out[o++]=bo>>8;
+			lit=-1;
+		}
+		else
+		{
+			if((lit<0)||(out[lit]==0x7F))
+			{
+				lit=o;
+				out[o++]=0;
+			}
+			out[lit]++;
+			out[o++]=src[i];
+		}
+		i+=n;
+	}
+	out[o++]=0;
+	free(head);
+	free(prev);
+	// find the in-place depacking margin: each output byte written must land below the first unread input byte
+	int in=0, d=0, worst=0;
+	while(out[in])
+	{
+		unsigned char c=out[in++];
+		int n=(c&0x80)?(c&0x7F)+3:c;
+		if(c&0x80)
+			in+=2;
+		for(i=0;i<n;i++)
+		{
+			if(c&0x80)
+				worst=max(worst, d+1-in);
+			else
+				worst=max(worst, d+1-(++in));
+			d++;
+		}
+	}
+	*margin=max(0, worst-len+o);
+	*dst=out;
+	return(o);
+}
+
+int unpack(const unsigned char *src, int len, unsigned char *dst, int max) // reference depacker; returns length of unpacked data, or -1
+{
+	int i=0, o=0;
+	while(i<len)
+	{
+		unsigned char c=src[i++];
+		if(!c)
+			return(o);
+		if(c&0x80)
+		{
+			if(i+2>len)
+				return(-1);
+			int n=(c&0x7F)+3, off=src[i]|(src[i+1]<<8);
+			i+=2;
+			if((off<1)||(off>o)||(o+n>max))
+				return(-1);
+			while(n--)
+			{
+				dst[o]=dst[o-off];
+				o++;
+			}
+		}
+		else
+		{
+			if((i+c>len)||(o+c>max))
+				return(-1);
+			memcpy(dst+o, src+i, c);
+			i+=c;
+			o+=c;
+		}
+	}
+	return(-1);
+}
+
+int mksysvars(unsigned char *mem, bas_seg *bas, int ramtop) // set up screen, system variables and stack as after LOAD of bas; returns STKEND, or -1
+{
+	#define SV(a,v)		{mem[(a)]=(v)&0xFF;mem[(a)+1]=(v)>>8;}
+	memset(mem+0x5800, 0x38, 0x300); // ATTR_P: black INK on white PAPER
+	const unsigned char strms[14]={0x01, 0x00, 0x06, 0x00, 0x0B, 0x00, 0x01, 0x00, 0x01, 0x00, 0x06, 0x00, 0x10, 0x00};
+	memcpy(mem+0x5C10, strms, 14);
+	const unsigned char chans[21]={0xF4, 0x09, 0xA8, 0x10, 'K', 0xF4, 0x09, 0xC4, 0x15, 'S', 0x81, 0x0F, 0xC4, 0x15, 'R', 0xF4, 0x09, 0xC4, 0x15, 'P', 0x80};
+	memcpy(mem+0x5CB6, chans, 21);
+	int prog=0x5CCB, vars=prog+(bas?bas->blen:0);
+	if(bas)
+		memcpy(mem+prog, bas->block, bas->blen);
+	int vlen=(bas&&bas->vars)?bas->vlen:0;
+	if(vlen)
+		memcpy(mem+vars, bas->vars, vlen);
+	mem[vars+vlen]=0x80; // end of variables
+	int eline=vars+vlen+1;
+	mem[eline]=0x0D; // empty edit line
+	mem[eline+1]=0x80;
+	int worksp=eline+2;
+	ramtop=min(ramtop-1, 0xFF57);
+	if(ramtop<worksp+0x100)
+	{
+		fprintf(stderr, "bast: No room for BASIC (ends at 0x%04X) below RAMTOP (0x%04X)\n", worksp, ramtop);
+		return(-1);
+	}
+	mem[0x5C00]=mem[0x5C04]=0xFF; // KSTATE
+	mem[0x5C09]=0x23; // REPDEL
+	mem[0x5C0A]=0x05; // REPPER
+	SV(0x5C36, 0x3C00); // CHARS
+	mem[0x5C38]=0x40; // RASP
+	mem[0x5C3A]=0xFF; // ERR_NR: OK
+	mem[0x5C3B]=0xCC; // FLAGS
+	SV(0x5C3D, ramtop-3); // ERR_SP
+	SV(0x5C42, bas?bas->line:0); // NEWPPC
+	SV(0x5C45, 0xFFFE); // PPC
+	mem[0x5C48]=0x38; // BORDCR
+	SV(0x5C4B, vars); // VARS
+	SV(0x5C4F, 0x5CB6); // CHANS
+	SV(0x5C51, 0x5CBB); // CURCHL: S
+	SV(0x5C53, prog); // PROG
+	SV(0x5C55, prog); // NXTLIN
+	SV(0x5C57, prog-1); // DATADD
+	SV(0x5C59, eline); // E_LINE
+	SV(0x5C5B, eline); // K_CUR
+	SV(0x5C5D, eline); // CH_ADD
+	SV(0x5C61, worksp); // WORKSP
+	SV(0x5C63, worksp); // STKBOT
+	SV(0x5C65, worksp); // STKEND
+	SV(0x5C68, 0x5C92); // MEM: MEMBOT
+	mem[0x5C6B]=2; // DF_SZ
+	SV(0x5C7B, 0xFF58); // UDG (the default UDGs are not set up, as we don't have the ROM)
+	mem[0x5C7F]=0x21; // P_POSN
+	SV(0x5C80, 0x5B00); // PR_CC
+	SV(0x5C82, 0x1721); // ECHO_E
+	SV(0x5C84, 0x4000); // DF_CC
+	SV(0x5C86, 0x50E0); // DFCCL
+	SV(0x5C88, 0x1821); // S_POSN
+	SV(0x5C8A, 0x1721); // SPOSNL
+	mem[0x5C8C]=1; // SCR_CT
+	mem[0x5C8D]=mem[0x5C8F]=0x38; // ATTR_P, ATTR_T
+	SV(0x5CB2, ramtop); // RAMTOP
+	SV(0x5CB4, 0xFFFF); // P_RAMT
+	mem[ramtop]=0x3E; // GO SUB stack end marker
+	SV(ramtop-3, 0x1303); // error return address, MAIN-4
+	#undef SV
+	return(worksp);
+}
+
+void dskname(char *buf, const char *name, bool code) // make an 8.3 filename for a segment; CODE files get .BIN
+{
+	int i=0;
+	while(*name&&(i<8))
+	{
+		if(isalnum(*name)||strchr("_-$#", *name))
+			buf[i++]=toupper(*name);
+		name++;
+	}
+	if(!i)
+		buf[i++]='_';
+	buf[i]=0;
+	if(code)
+		strcat(buf, ".BIN");
+}
+
+int writedsk(FILE *fp, dskfile *files, int nfiles) // write an extended DSK image of a +3 (173k, 40 track single-sided) disk
+{
+	#define DSK_TRACKS	40
+	#define DSK_SECTORS	9
+	#define DSK_BLOCKS	175 // 1k blocks after the reserved track; the first two hold the directory
+	#define DSK_DIRENTS	64
+	unsigned char *img=(unsigned char *)malloc(DSK_TRACKS*DSK_SECTORS*512);
+	memset(img, 0xE5, DSK_TRACKS*DSK_SECTORS*512);
+	const unsigned char spec[10]={0x00, 0x00, DSK_TRACKS, DSK_SECTORS, 0x02, 0x01, 0x03, 0x02, 0x2A, 0x52}; // disk specification, in the boot sector
+	memcpy(img, spec, 10);
+	unsigned char *dir=img+DSK_SECTORS*512, *blocks=dir;
+	int block=2, nent=0, f;
+	for(f=0;f<nfiles;f++)
+	{
+		// PLUS3DOS header
+		unsigned char hdr[128];
+		memset(hdr, 0, 128);
+		memcpy(hdr, "PLUS3DOS\x1A\x01\x00", 11);
+		int flen=files[f].len+128;
+		hdr[11]=flen;hdr[12]=flen>>8;hdr[13]=flen>>16;hdr[14]=flen>>24;
+		hdr[15]=files[f].type;
+		hdr[16]=files[f].len;hdr[17]=files[f].len>>8;
+		hdr[18]=files[f].param1;hdr[19]=files[f].param1>>8;
+		hdr[20]=files[f].param2;hdr[21]=files[f].param2>>8;
+		int i;
+		for(i=0;i<127;i++)
+			hdr[127]+=hdr[i];
+		int nrec=(flen+127)/128, nblk=(nrec+7)/8;
+		if(block+nblk>DSK_BLOCKS)
+		{
+			fprintf(stderr, "bast: Disk full: can't fit %s (%u bytes)\n", files[f].name, files[f].len);
+			free(img);
+			return(1);
+		}
+		unsigned char *p=blocks+block*1024;
+		memcpy(p, hdr, 128);
+		memcpy(p+128, files[f].data, files[f].len);
+		// directory entries, one per 16k extent
+		char n83[11];
+		memset(n83, ' ', 11);
+		const char *dot=strchr(files[f].name, '.');
+		memcpy(n83, files[f].name, dot?dot-files[f].name:(int)strlen(files[f].name));
+		if(dot)
+			memcpy(n83+8, dot+1, strlen(dot+1));
+		int ext;
+		for(ext=0;ext*128<nrec;ext++)
+		{
+			if(nent>=DSK_DIRENTS)
+			{
+				fprintf(stderr, "bast: Disk full: directory has no room for %s\n", files[f].name);
+				free(img);
+				return(1);
+			}
+			unsigned char *e=dir+32*nent++;
+			memset(e, 0, 32);
+			memcpy(e+1, n83, 11);
+			e[12]=ext&0x1F; // EX
+			e[14]=ext>>5; // S2
+			e[15]=min(nrec-ext*128, 128); // RC
+			for(i=0;(i<16)&&(ext*16+i<nblk);i++)
+				e[16+i]=block+ext*16+i;
+		}
+		fprintf(stderr, "bast: Wrote file %s (%u bytes, %u blocks)\n", files[f].name, files[f].len, nblk);
+		block+=nblk;
+	}
+	// Disk-Info block
+	unsigned char di[256];
+	memset(di, 0, 256);
+	memcpy(di, "EXTENDED CPC DSK File\r\nDisk-Info\r\n", 34);
+	memcpy(di+34, "bast", 4);
+	di[48]=DSK_TRACKS;
+	di[49]=1;
+	int t;
+	for(t=0;t<DSK_TRACKS;t++)
+		di[52+t]=(256+DSK_SECTORS*512)>>8;
+	fwrite(di, 1, 256, fp);
+	for(t=0;t<DSK_TRACKS;t++)
+	{
+		unsigned char ti[256];
+		memset(ti, 0, 256);
+		memcpy(ti, "Track-Info\r\n", 12);
+		ti[16]=t;
+		ti[20]=2; // 512 byte sectors
+		ti[21]=DSK_SECTORS;
+		ti[22]=0x4E; // GAP#3
+		ti[23]=0xE5; // filler
+		int s;
+		for(s=0;s<DSK_SECTORS;s++)
+		{
+			unsigned char *si=ti+24+8*s;
+			si[0]=t; // C
+			si[1]=0; // H
+			si[2]=s+1; // R
+			si[3]=2; // N
+			si[6]=0x00;si[7]=0x02; // data length 512
+		}
+		fwrite(ti, 1, 256, fp);
+		fwrite(img+t*DSK_SECTORS*512, 1, DSK_SECTORS*512, fp);
+	}
+	fprintf(stderr, "bast: Disk uses %u of %u blocks, %u of %u directory entries\n", block, DSK_BLOCKS, nent, DSK_DIRENTS);
+	free(img);
+	return(0);
+	#undef DSK_TRACKS
+	#undef DSK_SECTORS
+	#undef DSK_BLOCKS
+	#undef DSK_DIRENTS
+}
+
+void tape_block(tapeout *tape, const unsigned char *buf, int len) // buf[0] is the flag byte; the checksum is appended
+{
+	unsigned char cksum=0;
+	int i;
+	for(i=0;i<len;i++)
+		cksum^=buf[i];
+	if(!tape->wav)
+	{
+		fputc((len+1), tape->fp);
+		fputc((len+1)>>8, tape->fp);
+		fwrite(buf, 1, len, tape->fp);
+		fputc(cksum, tape->fp);
+		return;
+	}
+	// ROM timings: pilot 2168T (8063 pulses for a header, 3223 for data), sync 667T+735T, bits 855T (0) or 1710T (1) per pulse, then a second's pause
+	int p;
+	for(p=0;p<(buf[0]&0x80?3223:8063);p++)
+		wav_pulse(tape, 2168);
+	wav_pulse(tape, 667);
+	wav_pulse(tape, 735);
+	for(i=0;i<=len;i++)
+	{
+		unsigned char c=(i<len)?buf[i]:cksum;
+		int b;
+		for(b=0;b<8;b++)
+		{
+			int ts=(c&(0x80>>b))?1710:855;
+			wav_pulse(tape, ts);
+			wav_pulse(tape, ts);
+		}
+	}
+	wav_pulse(tape, 3500000); // the level change at its start ends the last pulse
+}
+
+void wav_start(tapeout *tape) // header for 8-bit mono PCM; the lengths are fixed up by wav_finish if we can seek, else left as 0xFFFFFFFF for streaming
+{
+	const unsigned char hdr[44]={'R', 'I', 'F', 'F', 0xFF, 0xFF, 0xFF, 0xFF, 'W', 'A', 'V', 'E', 'f', 'm', 't', ' ', 16, 0, 0, 0, 1, 0, 1, 0,
+		tape->rate, tape->rate>>8, tape->rate>>16, 0, tape->rate, tape->rate>>8, tape->rate>>16, 0, 1, 0, 8, 0, 'd', 'a', 't', 'a', 0xFF, 0xFF, 0xFF, 0xFF};
+	fwrite(hdr, 1, 44, tape->fp);
+	tape->t=0;
+	tape->samples=0;
+	tape->level=false;
+}
+
+void wav_pulse(tapeout *tape, int tstates) // write one pulse (a half-cycle at the current level) then flip the level
+{
+	tape->t+=tstates/tape->speed;
+	unsigned long end=tape->t*tape->rate/3500000.0;
+	while(tape->samples<end)
+	{
+		fputc(tape->level?0xC0:0x40, tape->fp);
+		tape->samples++;
+	}
+	tape->level=!tape->level;
+}
+
+void wav_finish(tapeout *tape)
+{
+	if(fseek(tape->fp, 4, SEEK_SET)==0)
+	{
+		unsigned long l=tape->samples+36;
+		unsigned char b[4]={l, l>>8, l>>16, l>>24};
+		fwrite(b, 1, 4, tape->fp);
+		fseek(tape->fp, 40, SEEK_SET);
+		l=tape->samples;
+		unsigned char c[4]={l, l>>8, l>>16, l>>24};
+		fwrite(c, 1, 4, tape->fp);
+	}
+	fprintf(stderr, "bast: Wrote %lu samples (%.1f seconds)\n", tape->samples, tape->samples/(double)tape->rate);
+}
+
+int bassize(segment *data, int nsegs) // total size of the BASIC segments (and their #vars) as they stand, or -1 on error.  Labels and !load count at their placeholder sizes
+{
+	int i, total=0;
+	for(i=0;i<nsegs;i++)
+	{
+		if(data[i].type!=BASIC) continue;
+		data[i].data.bas.blen=0;
+		buildbas(&data[i].data.bas, false);
+		if(data[i].data.bas.blen<0)
+			return(-1);
+		total+=data[i].data.bas.blen+data[i].data.bas.vlen;
+	}
+	return(total);
+}
+
+int opt_cutnumbers(__attribute__((unused)) int *nsegs, __attribute__((unused)) segment **data, __attribute__((unused)) char **inbas) // the cutting is done by buildbas() and append_num(), as linked numbers only appear later
+{
+	Ocutnumbers=true;
+	return(0);
+}
+
+bool ast_const(astnode *n, double *value) // is n a numeric expression of literals, which folds to *value?  Each result is rounded to a ZX float, as the ROM's calculator does
+{
+	double a, b;
+	long double r;
+	astnode *x, *y;
+	switch(n->type)
+	{
+		case AST_NUM:
+			*value=zxvalue(n->items[0].tok.data2);
+			return(true);
+		case AST_PAREN:
+			return((n->nitems==3)&&n->items[1].node&&ast_const(n->items[1].node, value));
+		case AST_UNOP:
+			if(!ast_const(n->items[1].node, &a)) return(false);
+			*value=(n->op=='-')?-a:(n->op=='+')?a:(a==0); // NOT
+			return(true);
+		case AST_FUNC:
+			if((n->nitems!=2)||!n->items[1].node||!ast_const(n->items[1].node, &a)) return(false);
+			switch(n->op)
+			{
+				case 0xBC: // SGN
+					*value=(a>0)-(a<0);
+					return(true);
+				case 0xBA: // INT rounds down
+					*value=floor(a);
+					return(true);
+				case 0xBD: // ABS
+					*value=fabs(a);
+					return(true);
+				default: // SQR is x^0.5 to the ROM, so not folded, as ^ isn't
+					return(false);
+			}
+		break;
+		case AST_BINOP:
+			x=n->items[0].node;
+			y=n->items[2].node;
+			if(x->str||y->str||!ast_const(x, &a)||!ast_const(y, &b)) return(false);
+			switch(n->op)
+			{
+				case '+':
+					r=(long double)a+b;
+				break;
+				case '-':
+					r=(long double)a-b;
+				break;
+				case '*':
+					r=(long double)a*b;
+				break;
+				case '/':
+					if(b==0) return(false); // 6 Number too big, at run time
+					r=(long double)a/b;
+				break;
+				case '=':
+					*value=(a==b);
+					return(true);
+				case '<':
+					*value=(a<b);
+					return(true);
+				case '>':
+					*value=(a>b);
+					return(true);
+				case 0xC7: // <=
+					*value=(a<=b);
+					return(true);
+				case 0xC8: // >=
+					*value=(a>=b);
+					return(true);
+				case 0xC9: // <>
+					*value=(a!=b);
+					return(true);
+				case 0xC6: // AND
+					*value=b?a:0;
+					return(true);
+				case 0xC5: // OR
+					*value=b?1:a;
+					return(true);
+				default: // including ^, which the ROM does as EXP (y*LN x), so not exactly
+					return(false);
+			}
+		break;
+		default:
+			return(false);
+	}
+	if(!zxfits(r)) // left for the ROM to report
+		return(false);
+	char buf[5];
+	zxfloat(buf, r);
+	*value=zxvalue(buf);
+	return(true);
+}
+
+astnode *ast_num(double value) // a literal: a number, or '-' and a number
+{
+	astnode *n=ast_new(AST_NUM, TOKEN_ZXFLOAT);
+	ast_tok(n, mknum(fabs(value)));
+	if(value<0)
+	{
+		astnode *u=ast_new(AST_UNOP, '-');
+		ast_tok(u, mktok('-'));
+		ast_add(u, n);
+		n=u;
+	}
+	ast_size(n);
+	return(n);
+}
+
+int ast_fold(astnode *n) // replace each largest constant subexpression in n with its value; returns how many were replaced
+{
+	int i, count=0;
+	for(i=0;i<n->nitems;i++)
+	{
+		astnode *c=n->items[i].node;
+		if(!c) continue;
+		double value;
+		if((c->type==AST_NUM)||((c->type==AST_UNOP)&&(c->op=='-')&&(c->items[1].node->type==AST_NUM))||!ast_const(c, &value))
+		{
+			count+=ast_fold(c);
+			continue;
+		}
+		astnode *f=ast_num(value);
+		if((value<0)&&(((n->type==AST_BINOP)&&(n->op=='^')&&!i)||(n->type==AST_FUNC)||(n->type==AST_UNOP))) // -x^y would be -(x^y), and SIN -2^2 is SIN -(2^2)
+		{
+			astnode *p=ast_new(AST_PAREN, '(');
+			ast_tok(p, mktok('('));
+			ast_add(p, f);
+			ast_tok(p, mktok(')'));
+			f=p;
+		}
+		if(ast_size(f)>c->size) // eg. 1/3 is 5 bytes shorter than 0.3333333333; leave it, but fold inside it
+		{
+			ast_free(f);
+			count+=ast_fold(c);
+			continue;
+		}
+		if(debug) fprintf(stderr, "bast: constant-arithmetic: folded %u bytes to %u\n", c->size, ast_size(f));
+		ast_free(c);
+		n->items[i].node=f;
+		count++;
+	}
+	return(count);
+}
+
+int opt_constarith(int *nsegs, segment **data, __attribute__((unused)) char **inbas) // fold constant subexpressions
+{
+	int i, j;
+	for(i=0;i<*nsegs;i++)
+	{
+		if((*data)[i].type!=BASIC) continue;
+		bas_seg *bas=&(*data)[i].data.bas;
+		int count=0;
+		for(j=0;j<bas->nlines;j++)
+		{
+			astnode *ast=ast_parse(&bas->basic[j]);
+			if(!ast) continue;
+			int n=ast_fold(ast);
+			if(n)
+				ast_toline(ast, &bas->basic[j]);
+			count+=n;
+			ast_free(ast);
+		}
+		if(count)
+			fprintf(stderr, "bast: constant-arithmetic: %s: folded %u expressions\n", (*data)[i].name, count);
+	}
+	return(0);
+}
+
+bool ast_whole(astnode *n) // is n always a whole number, so that INT n is n?
+{
+	switch(n->type)
+	{
+		case AST_NUM:
+			return(zxvalue(n->items[0].tok.data2)==floor(zxvalue(n->items[0].tok.data2)));
+		case AST_PAREN:
+			return((n->nitems==3)&&n->items[1].node&&ast_whole(n->items[1].node));
+		case AST_UNOP: // NOT gives 0 or 1
+			return((n->op==0xC3)||ast_whole(n->items[1].node));
+		case AST_FUNC:
+			switch(n->op)
+			{
+				case 0xA9: // POINT
+				case 0xAB: // ATTR
+				case 0xAF: // CODE
+				case 0xB1: // LEN
+				case 0xBA: // INT
+				case 0xBC: // SGN
+				case 0xBE: // PEEK
+				case 0xBF: // IN
+				case 0xC0: // USR
+					return(true);
+				case 0xBD: // ABS
+					return((n->nitems==2)&&n->items[1].node&&ast_whole(n->items[1].node));
+				default:
+					return(false);
+			}
+		case AST_BINOP:
+			switch(n->op)
+			{
+				case '+': // whole ZX floats below 2^31 add and multiply exactly, and every ZX float from there up is whole
+				case '-':
+				case '*':
+					return(!n->str&&ast_whole(n->items[0].node)&&ast_whole(n->items[2].node));
+				case '=':
+				case '<':
+				case '>':
+				case 0xC7: // <=
+				case 0xC8: // >=
+				case 0xC9: // <>
+					return(true);
+				default:
+					return(false);
+			}
+		default:
+			return(false);
+	}
+}
+
+int ast_reduce(astnode *n, const char *seg, int sline) // rewrite slow operations under n into exactly equivalent cheaper ones; returns how many
+{
+	int i, count=0;
+	for(i=0;i<n->nitems;i++)
+	{
+		astnode *c=n->items[i].node;
+		if(!c) continue;
+		count+=ast_reduce(c, seg, sline);
+		if((c->type==AST_FUNC)&&(c->op==0xBA)&&(c->nitems==2)&&c->items[1].node&&ast_whole(c->items[1].node)) // INT of a whole number, eg. INT (INT (x/2)+1) or INT PEEK a, is a wasted call
+		{
+			astnode *r=c->items[1].node;
+			if((r->type==AST_PAREN)&&(r->nitems==3)) // ast_wrap() puts back any brackets it still needs
+			{
+				astnode *p=r;
+				r=p->items[1].node;
+				free(p->items);
+				free(p);
+			}
+			free(c->items);
+			free(c);
+			n->items[i].node=ast_wrap(n, i, r);
+			count++;
+			fprintf(stderr, "bast: strength-reduce: INT x -> x, for whole x\n\t%s:%u\n", seg, sline);
+			continue;
+		}
+		if(c->type!=AST_BINOP) continue;
+		astnode *x=c->items[0].node, *y=c->items[2].node, *r=NULL;
+		double v;
+		int ex;
+		const char *what=NULL;
+		if((c->op=='^')&&(y->type==AST_NUM)&&(x->type==AST_VAR)&&!x->str&&(zxvalue(y->items[0].tok.data2)==2)) // x^2 is EXP (2*LN x); x*x is exact, and works for x<0 too
+		{
+			r=ast_binop(x, '*', ast_copyvar(x));
+			ast_free(y);
+			what="x^2 -> x*x";
+		}
+		else if((c->op=='^')&&(y->type==AST_NUM)&&(zxvalue(y->items[0].tok.data2)==0.5)) // the ROM's SQR is x^0.5
+		{
+			r=ast_new(AST_FUNC, 0xBB);
+			ast_tok(r, mktok(0xBB));
+			ast_add(r, (ast_prio(x)<16)?ast_paren(x):x);
+			ast_free(y);
+			what="x^0.5 -> SQR x";
+		}
+		else if((c->op=='/')&&(y->type==AST_NUM)&&((v=zxvalue(y->items[0].tok.data2))!=1)&&(v>0)&&(frexp(v, &ex)==0.5)&&zxfits(1/v)) // scaling by a power of two is exact either way, and multiplying is quicker
+		{
+			c->op='*';
+			c->items[1].tok.tok='*';
+			c->items[2].node=ast_num(1/v);
+			ast_free(y);
+			count++;
+			fprintf(stderr, "bast: strength-reduce: x/c -> x*(1/c)\n\t%s:%u\n", seg, sline);
+			continue;
+		}
+		else if((c->op=='*')&&(((x->type==AST_VAR)&&!x->str&&(y->type==AST_NUM)&&(zxvalue(y->items[0].tok.data2)==2))||((y->type==AST_VAR)&&!y->str&&(x->type==AST_NUM)&&(zxvalue(x->items[0].tok.data2)==2)))) // x+x is exact too, and shorter and quicker
+		{
+			if(x->type==AST_NUM)
+			{
+				ast_free(x);
+				x=y;
+			}
+			else
+			{
+				ast_free(y);
+			}
+			r=ast_binop(x, '+', ast_copyvar(x));
+			what="x*2 -> x+x";
+		}
+		if(!r) continue;
+		free(c->items);
+		free(c);
+		n->items[i].node=ast_wrap(n, i, r);
+		count++;
+		fprintf(stderr, "bast: strength-reduce: %s\n\t%s:%u\n", what, seg, sline);
+	}
+	return(count);
+}
+
+int opt_strength(int *nsegs, segment **data, __attribute__((unused)) char **inbas) // replace slow calculator operations with quicker equivalents
+{
+	int i, j;
+	for(i=0;i<*nsegs;i++)
+	{
+		if((*data)[i].type!=BASIC) continue;
+		bas_seg *bas=&(*data)[i].data.bas;
+		for(j=0;j<bas->nlines;j++)
+		{
+			astnode *ast=ast_parse(&bas->basic[j]);
+			if(!ast) continue;
+			if(ast_reduce(ast, (*data)[i].name, bas->basic[j].sline))
+				ast_toline(ast, &bas->basic[j]);
+			ast_free(ast);
+		}
+	}
+	return(0);
+}
+
+astnode *ast_small(double value, bool bare, int *size) // the shortest expression for a literal (bare: nothing follows it in the expression, so NOT needn't be bracketed), or NULL if there's nothing shorter than *size; sets *size
+{
+	astnode *best=NULL, *n;
+	int cost;
+	char text[16];
+	if((value==0)||(value==1)||(value==3)) // NOT PI, SGN PI, INT PI
+	{
+		n=ast_func((value==0)?0xC3:(value==1)?0xBC:0xBA, ast_func(0xA7, NULL));
+		cost=2;
+		if(!value&&!bare) // NOT binds loosely
+		{
+			n=ast_paren(n);
+			cost+=2;
+		}
+		if(cost<*size)
+		{
+			best=n;
+			*size=cost;
+		}
+		else
+		{
+			ast_free(n);
+		}
+	}
+	if((value>=32)&&(value<=127)&&(value==floor(value))&&(value!='"')&&(4<*size)) // CODE "c"
+	{
+		token t=mktok(TOKEN_STRING);
+		t.data=(char *)malloc(2);
+		t.data[0]=value;
+		t.data[1]=0;
+		n=ast_new(AST_STR, TOKEN_STRING);
+		ast_tok(n, t);
+		n->str=true;
+		ast_free(best);
+		best=ast_func(0xAF, n);
+		*size=4;
+	}
+	if((value==floor(value))&&(value<4294967296.0)) // VAL "digits": the ROM reads integers exactly
+	{
+		sprintf(text, "%.0f", value);
+		if((int)strlen(text)+3<*size)
+		{
+			token t=mktok(TOKEN_STRING);
+			t.data=strdup(text);
+			n=ast_new(AST_STR, TOKEN_STRING);
+			ast_tok(n, t);
+			n->str=true;
+			ast_free(best);
+			best=ast_func(0xB0, n);
+			*size=strlen(text)+3;
+		}
+	}
+	if(best)
+		ast_size(best);
+	return(best);
+}
+
+int ast_smalllit(astnode *n, int *saved) // rewrite the literals under n in their shortest forms; returns how many
+{
+	int i, count=0;
+	if((n->type==AST_FUNC)&&(n->op==0xC4)) // BIN's digits aren't a number
+		return(0);
+	for(i=0;i<n->nitems;i++)
+	{
+		astnode *c=n->items[i].node;
+		if(!c) continue;
+		if(c->type!=AST_NUM)
+		{
+			count+=ast_smalllit(c, saved);
+			continue;
+		}
+		int size=c->size;
+		astnode *r=ast_small(zxvalue(c->items[0].tok.data2), (n->type!=AST_BINOP)&&(n->type!=AST_UNOP)&&(n->type!=AST_FUNC), &size);
+		if(!r) continue;
+		*saved+=c->size-size;
+		ast_free(c);
+		n->items[i].node=r;
+		count++;
+	}
+	return(count);
+}
+
+int opt_smalllit(int *nsegs, segment **data, __attribute__((unused)) char **inbas) // write numbers as NOT PI, SGN PI, INT PI, CODE "c" or VAL "n" where that's shorter
+{
+	int i, j;
+	for(i=0;i<*nsegs;i++)
+	{
+		if((*data)[i].type!=BASIC) continue;
+		bas_seg *bas=&(*data)[i].data.bas;
+		int count=0, saved=0;
+		for(j=0;j<bas->nlines;j++)
+		{
+			astnode *ast=ast_parse(&bas->basic[j]);
+			if(!ast) continue;
+			int n=ast_smalllit(ast, &saved);
+			if(n)
+				ast_toline(ast, &bas->basic[j]);
+			count+=n;
+			ast_free(ast);
+		}
+		if(count)
+			fprintf(stderr, "bast: small-literals: %s: rewrote %u numbers, saving %u bytes\n", (*data)[i].name, count, saved);
+	}
+	return(0);
+}
+
+void pool_count(astnode *n, poolval **vals, int *nvals) // tally the literals under n by value
+{
+	int i, j;
+	if((n->type==AST_FUNC)&&(n->op==0xC4)) // BIN's digits aren't a number
+		return;
+	for(i=0;i<n->nitems;i++)
+	{
+		astnode *c=n->items[i].node;
+		if(!c) continue;
+		if(c->type!=AST_NUM)
+		{
+			pool_count(c, vals, nvals);
+			continue;
+		}
+		for(j=0;j<*nvals;j++)
+			if(!memcmp((*vals)[j].zx, c->items[0].tok.data2, 5)) break;
+		if(j==*nvals)
+		{
+			*vals=(poolval *)realloc(*vals, ++*nvals*sizeof(poolval));
+			memcpy((*vals)[j].zx, c->items[0].tok.data2, 5);
+			(*vals)[j].uses=0;
+			(*vals)[j].bytes=0;
+			(*vals)[j].name=0;
+		}
+		(*vals)[j].uses++;
+		(*vals)[j].bytes+=c->size;
+	}
+}
+
+int pool_replace(astnode *n, poolval *vals, int nvals) // replace pooled literals under n with their variables; returns how many
+{
+	int i, j, count=0;
+	if((n->type==AST_FUNC)&&(n->op==0xC4))
+		return(0);
+	for(i=0;i<n->nitems;i++)
+	{
+		astnode *c=n->items[i].node;
+		if(!c) continue;
+		if(c->type!=AST_NUM)
+		{
+			count+=pool_replace(c, vals, nvals);
+			continue;
+		}
+		for(j=0;j<nvals;j++)
+			if(vals[j].name&&!memcmp(vals[j].zx, c->items[0].tok.data2, 5)) break;
+		if(j==nvals) continue;
+		astnode *v=ast_new(AST_VAR, TOKEN_VAR);
+		token t=mktok(TOKEN_VAR);
+		t.data=(char *)malloc(2);
+		t.data[0]=vals[j].name;
+		t.data[1]=0;
+		ast_tok(v, t);
+		ast_size(v);
+		ast_free(c);
+		n->items[i].node=v;
+		count++;
+	}
+	return(count);
+}
+
+bool usedletters(bas_seg *bas, bool *used) // which single-letter numeric variables the segment (or its #vars) uses; true if it has RUN or CLEAR, which delete them
+{
+	int j, k, w;
+	bool clears=false, unseen=false;
+	memset(used, 0, 26*sizeof(bool));
+	for(j=0;j<bas->nlines;j++)
+	{
+		basline *b=&bas->basic[j];
+		for(k=0;k<b->ntok;k++)
+		{
+			token *t=&b->tok[k];
+			if((t->tok==TOKEN_VAR)&&isalpha(t->data[0])&&!t->data[1])
+				used[tolower(t->data[0])-'a']=true;
+			if((t->tok==0xF7)||(t->tok==0xFD)) // RUN, CLEAR
+				clears=true;
+			if((t->tok==0xB0)||(t->tok==0xAE)) // VAL, VAL$: the words in the string may be variable names, as for short-vars
+			{
+				int l=k+1;
+				while((l<b->ntok)&&(b->tok[l].tok=='('))
+					l++;
+				if((l<b->ntok)&&(b->tok[l].tok==TOKEN_STRING))
+				{
+					varname *words=NULL;
+					int nwords=0;
+					sv_vals(b->tok[l].data, &words, &nwords);
+					for(w=0;w<nwords;w++)
+					{
+						if(!words[w].name[1])
+							used[words[w].name[0]-'a']=true;
+						free(words[w].name);
+					}
+					free(words);
+				}
+				else // a worked-out string could name any of them
+					unseen=true;
+			}
+		}
+	}
+	if(unseen)
+		memset(used, 1, 26*sizeof(bool));
+	for(j=0;j<bas->vlen;) // #vars
+	{
+		unsigned char b=bas->vars[j];
+		switch(b>>5)
+		{
+			case 3: // single-letter number
+				used[(b&0x1F)-1]=true;
+				j+=6;
+			break;
+			case 7: // FOR control variable
+				used[(b&0x1F)-1]=true;
+				j+=19;
+			break;
+			case 5: // long-named number
+				j++;
+				while(!(bas->vars[j++]&0x80));
+				j+=5;
+			break;
+			default: // strings and arrays
+				j+=3+((unsigned char)bas->vars[j+1]|((unsigned char)bas->vars[j+2]<<8));
+			break;
+		}
+	}
+	return(clears);
+}
+
+int opt_pool(int *nsegs, segment **data, char **inbas) // move repeated literals into single-letter variables
+{
+	int i, j, k;
+	for(i=0;i<*nsegs;i++)
+	{
+		if((*data)[i].type!=BASIC) continue;
+		bas_seg *bas=&(*data)[i].data.bas;
+		if((bas->ovstart>=0)||(bas->ovparent>=0)) // the overlays' variables are the resident part's
+			continue;
+		bool used[26];
+		if(usedletters(bas, used))
+		{
+			fprintf(stderr, "bast: pool-constants: not pooling in %s, as it uses RUN or CLEAR, which would delete the variables\n", (*data)[i].name);
+			continue;
+		}
+		int nvals=0, first=-1;
+		poolval *vals=NULL;
+		for(j=0;j<bas->nlines;j++)
+		{
+			astnode *ast=ast_parse(&bas->basic[j]);
+			if(!ast) continue;
+			if(first<0)
+				first=j;
+			pool_count(ast, &vals, &nvals);
+			ast_free(ast);
+		}
+		if(first<0)
+			continue;
+		bool invars=(bas->line!=0); // started by its autostart line, so variables saved with it survive; else RUN clears them, and we LET them in a new first line
+		if(!invars&&!bas->renum&&(bas->basic[first].number<=1))
+		{
+			fprintf(stderr, "bast: pool-constants: not pooling in %s, as there's no line number free before its first line\n", (*data)[i].name);
+			free(vals);
+			continue;
+		}
+		int saved=invars?0:-5, npooled=0; // a line costs 4 bytes of header, and an ENTER
+		char init[4096]="", names[27]="";
+		while(true) // pick the most profitable, while it profits
+		{
+			int best=-1, bestgain=0;
+			for(j=0;j<nvals;j++)
+			{
+				if(vals[j].name) continue;
+				token t=mknum(fabs(zxvalue(vals[j].zx)));
+				int gain=vals[j].bytes-vals[j].uses-(invars?6:3+toksize(&t)+(npooled?1:0)); // each use becomes 1 byte; the value costs 6 bytes of VARS, or 'LET x=<num>' (and a ':')
+				free(t.data);
+				free(t.data2);
+				if((zxvalue(vals[j].zx)<0)||(gain<=bestgain)) continue;
+				best=j;
+				bestgain=gain;
+			}
+			for(k=0;(k<26)&&used[k];k++);
+			if((best<0)||(k==26)||(strlen(init)>sizeof(init)-64))
+				break;
+			used[k]=true;
+			vals[best].name='a'+k;
+			names[npooled++]='a'+k;
+			saved+=bestgain;
+			char text[16];
+			zxtext(text, zxvalue(vals[best].zx));
+			sprintf(init+strlen(init), invars?"%s%c=%s":"%sLET %c=%s", (npooled>1)?":":"", 'a'+k, text);
+		}
+		if(!npooled||(saved<=0)) // not worth a line
+		{
+			free(vals);
+			continue;
+		}
+		if(invars)
+		{
+			char *p=strtok(init, ":");
+			while(p)
+			{
+				if(addvar(bas, p))
+				{
+					fprintf(stderr, "bast: Internal error: pool-constants: failed to add variable %s\n", p);
+					return(1);
+				}
+				p=strtok(NULL, ":");
+			}
+		}
+		int count=0;
+		for(j=0;j<bas->nlines;j++)
+		{
+			astnode *ast=ast_parse(&bas->basic[j]);
+			if(!ast) continue;
+			int n=pool_replace(ast, vals, nvals);
+			if(n)
+				ast_toline(ast, &bas->basic[j]);
+			count+=n;
+			ast_free(ast);
+		}
+		if(!invars) // a new first line, to set them up
+		{
+			char line[4200];
+			if(bas->renum)
+				strcpy(line, init);
+			else
+				sprintf(line, "%u %s", bas->basic[first].number-1, init);
+			if(addbasline(&bas->nlines, &bas->basic, line))
+			{
+				fprintf(stderr, "bast: Internal error: pool-constants: failed to add line\n");
+				return(1);
+			}
+			basline b=bas->basic[bas->nlines-1];
+			memmove(bas->basic+first+1, bas->basic+first, (bas->nlines-first-1)*sizeof(basline));
+			bas->basic[first]=b;
+			bas->basic[first].sline=bas->basic[first+1].sline;
+			err=false;
+			tokenise(&bas->basic[first], inbas, bas->fbas, bas->renum);
+			if(err) return(1);
+			bas->blines++;
+		}
+		fprintf(stderr, "bast: pool-constants: %s: pooled %u constants (%u uses) in %s%s, saving %u bytes\n", (*data)[i].name, npooled, count, names, invars?" (saved with the program)":"", saved);
+		free(vals);
+	}
+	return(0);
+}
+
+int opt_shortnum(int *nsegs, segment **data, __attribute__((unused)) char **inbas) // rewrite each literal's text as the shortest that reads back as the same number
+{
+	Oshortnumbers=true; // numbers made by later passes, and %label line numbers, are written short too
+	if(Ocutnumbers) // the texts are cut to '.' anyway
+		return(0);
+	int i, j, k;
+	for(i=0;i<*nsegs;i++)
+	{
+		if((*data)[i].type!=BASIC) continue;
+		bas_seg *bas=&(*data)[i].data.bas;
+		int count=0, saved=0;
+		for(j=0;j<bas->nlines;j++)
+		{
+			for(k=0;k<bas->basic[j].ntok;k++)
+			{
+				token *t=&bas->basic[j].tok[k];
+				if((t->tok!=TOKEN_ZXFLOAT)||!t->data||!t->data2) continue;
+				if(k&&(bas->basic[j].tok[k-1].tok==0xC4)) continue; // BIN digits aren't decimal
+				char text[32];
+				if(!zxshort(text, zxvalue(t->data2), t->data)) continue; // no shorter text the ROM reads back as it would the original: leave it as written
+				int d=strlen(t->data)-strlen(text);
+				if(d<=0) continue;
+				free(t->data);
+				t->data=strdup(text);
+				count++;
+				saved+=d;
+			}
+		}
+		if(count)
+			fprintf(stderr, "bast: short-numbers: %s: shortened %u numbers, saving %u bytes\n", (*data)[i].name, count, saved);
+	}
+	return(0);
+}
+
+int sv_find(varname **vars, int *nvars, const char *name, int len) // index of (the first len letters of) name, adding it if new
+{
+	int i, j;
+	for(i=0;i<*nvars;i++)
+		if(((int)strlen((*vars)[i].name)==len)&&!strncasecmp((*vars)[i].name, name, len))
+			return(i);
+	*vars=(varname *)realloc(*vars, ++*nvars*sizeof(varname));
+	varname *v=&(*vars)[i];
+	v->name=(char *)malloc(len+1);
+	for(j=0;j<len;j++)
+		v->name[j]=tolower(name[j]);
+	v->name[len]=0;
+	v->uses=0;
+	v->to[0]=0;
+	v->keep=false;
+	return(i);
+}
+
+void sv_vals(const char *str, varname **vars, int *nvars) // the words in a VAL string may be variable names, so keep them
+{
+	while(*str)
+	{
+		int l=0;
+		while(isalpha(str[l]))
+			l++;
+		if(l)
+		{
+			int v=sv_find(vars, nvars, str, l);
+			(*vars)[v].keep=true;
+			str+=l;
+		}
+		else
+			str++;
+	}
+}
+
+int sv_cmp(const void *a, const void *b) // busiest first
+{
+	const varname *x=a, *y=b;
+	if(x->uses!=y->uses)
+		return(y->uses-x->uses);
+	return(strcmp(x->name, y->name));
+}
+
+int opt_shortvars(int *nsegs, segment **data, __attribute__((unused)) char **inbas) // rename long numeric variables to the shortest free names
+{
+	// All the BASIC segments share one mapping, as a program's overlays (and chained programs) share their variables
+	int i, j, k, nvars=0;
+	varname *vars=NULL;
+	for(i=0;i<*nsegs;i++)
+	{
+		if((*data)[i].type!=BASIC) continue;
+		bas_seg *bas=&(*data)[i].data.bas;
+		for(j=0;j<bas->nlines;j++)
+		{
+			for(k=0;k<bas->basic[j].ntok;k++)
+			{
+				token *t=&bas->basic[j].tok[k];
+				if(t->tok==TOKEN_VAR) // single letters are counted too, so that they aren't handed out
+				{
+					int v=sv_find(&vars, &nvars, t->data, strlen(t->data));
+					vars[v].uses++;
+				}
+				else if((t->tok==0xB0)||(t->tok==0xAE)) // VAL, VAL$
+				{
+					int l=k+1;
+					while((l<bas->basic[j].ntok)&&(bas->basic[j].tok[l].tok=='('))
+						l++;
+					if((l<bas->basic[j].ntok)&&(bas->basic[j].tok[l].tok==TOKEN_STRING))
+						sv_vals(bas->basic[j].tok[l].data, &vars, &nvars);
+					else
+						fprintf(stderr, "bast: short-vars: Warning: %s of a worked-out string might name a variable that gets renamed\n\t"LOC"\n", tokname(t->tok), (*data)[i].name, j);
+				}
+			}
+		}
+		for(j=0;j<bas->vlen;) // #vars keep their names
+		{
+			unsigned char b=bas->vars[j];
+			char name[256]={(b&0x1F)+0x60, 0};
+			switch(b>>5)
+			{
+				case 3: // single-letter number
+					j+=6;
+				break;
+				case 7: // FOR control variable
+					j+=19;
+				break;
+				case 5: // long-named number
+					k=1;
+					do
+						name[k]=bas->vars[j+k]&0x7F;
+					while(!(bas->vars[j+k++]&0x80)&&(k<255));
+					name[k]=0;
+					j+=k+5;
+				break;
+				default: // strings and arrays have their own names
+					j+=3+((unsigned char)bas->vars[j+1]|((unsigned char)bas->vars[j+2]<<8));
+					name[0]=0;
+				break;
+			}
+			if(*name)
+			{
+				int v=sv_find(&vars, &nvars, name, strlen(name));
+				vars[v].keep=true;
+			}
+		}
+	}
+	if(!nvars) // qsort() mustn't be given a NULL array, even an empty one
+		return(0);
+	qsort(vars, nvars, sizeof(varname), sv_cmp);
+	char next[3]="a";
+	int count=0, saved=0;
+	for(i=0;i<nvars;i++)
+	{
+		int len=strlen(vars[i].name);
+		if((len<2)||vars[i].keep) continue;
+		while(next[0]) // the next name that nothing uses, and that isn't a keyword (so that the listing reads back)
+		{
+			bool taken=false;
+			for(j=0;(j<nvars)&&!taken;j++)
+				taken=!strcmp(vars[j].name, next)||!strcmp(vars[j].to, next);
+			for(j=0;(j<ntokens)&&!taken;j++)
+				taken=!strcasecmp(tokentable[j].text, next);
+			if(!taken) break;
+			if(!next[1]) // a..z, then aa..zz
+			{
+				if(next[0]<'z')
+					next[0]++;
+				else
+					strcpy(next, "aa");
+			}
+			else if(next[1]<'z')
+				next[1]++;
+			else if(next[0]<'z')
+			{
+				next[0]++;
+				next[1]='a';
+			}
+			else // out of names
+				next[0]=0;
+		}
+		if(!next[0]||((int)strlen(next)>=len)) continue;
+		strcpy(vars[i].to, next);
+		count++;
+		saved+=vars[i].uses*(len-strlen(next));
+	}
+	if(!count)
+	{
+		for(i=0;i<nvars;i++)
+			free(vars[i].name);
+		free(vars);
+		return(0);
+	}
+	for(i=0;i<*nsegs;i++)
+	{
+		if((*data)[i].type!=BASIC) continue;
+		bas_seg *bas=&(*data)[i].data.bas;
+		for(j=0;j<bas->nlines;j++)
+		{
+			for(k=0;k<bas->basic[j].ntok;k++)
+			{
+				token *t=&bas->basic[j].tok[k];
+				if(t->tok!=TOKEN_VAR) continue;
+				int v=sv_find(&vars, &nvars, t->data, strlen(t->data));
+				if(!vars[v].to[0]) continue;
+				free(t->data);
+				t->data=strdup(vars[v].to);
+			}
+		}
+	}
+	FILE *map=NULL;
+	if(Ooutfile&&strcmp(Ooutfile, "-"))
+	{
+		char *mapname=(char *)malloc(strlen(Ooutfile)+5);
+		sprintf(mapname, "%s.map", Ooutfile);
+		if(!(map=fopen(mapname, "w")))
+			fprintf(stderr, "bast: short-vars: Warning: could not open %s for the variable map\n", mapname);
+		else
+			fprintf(stderr, "bast: short-vars: writing variable map to %s\n", mapname);
+		free(mapname);
+	}
+	for(i=0;i<nvars;i++)
+	{
+		if(!vars[i].to[0]) continue;
+		if(map)
+			fprintf(map, "%s\t%s\t%u\n", vars[i].name, vars[i].to, vars[i].uses);
+		if(debug)
+			fprintf(stderr, "bast: short-vars: %s -> %s (%u uses)\n", vars[i].name, vars[i].to, vars[i].uses);
+	}
+	if(map)
+		fclose(map);
+	fprintf(stderr, "bast: short-vars: renamed %u variables, saving %u bytes\n", count, saved);
+	for(i=0;i<nvars;i++)
+		free(vars[i].name);
+	free(vars);
+	return(0);
+}
+
+int dl_first(bas_seg *bas, int j) // the first real line from j on, or -1
+{
+	for(;j<bas->nlines;j++)
+		if(bas->basic[j].ntok)
+			return(j);
+	return(-1);
+}
+
+int dl_number(bas_seg *bas, int n) // the line GO TO n goes to (the first numbered n or more), or -1
+{
+	int j;
+	for(j=0;j<bas->nlines;j++)
+		if(bas->basic[j].ntok&&(bas->basic[j].number>=n))
+			return(j);
+	return(-1);
+}
+
+bool dl_label(int nsegs, segment *data, const char *name, lineref *at) // find the line a label points to
+{
+	int i, j;
+	for(i=0;i<nsegs;i++)
+	{
+		if(data[i].type!=BASIC) continue;
+		bas_seg *bas=&data[i].data.bas;
+		for(j=0;j<bas->nlines;j++)
+		{
+			if(bas->basic[j].ntok||(*bas->basic[j].text!='.')||strcmp(bas->basic[j].text+1, name)) continue;
+			at->seg=i;
+			at->line=dl_first(bas, j);
+			return(at->line>=0);
+		}
+	}
+	return(false);
+}
+
+void dl_push(lineref **work, int *nwork, int seg, int line)
+{
+	if(line<0) return;
+	*work=(lineref *)realloc(*work, ++*nwork*sizeof(lineref));
+	(*work)[*nwork-1]=(lineref){seg, line};
+}
+
+bool dl_walk(astnode *blk, bas_seg *bas, int s, lineref **work, int *nwork, bool *computed) // follow a line's statements; false if control can't run off its end
+{
+	int i, j;
+	for(i=0;i<blk->nitems;i++)
+	{
+		astnode *n=blk->items[i].node;
+		if(!n||(n->type!=AST_STMT)) continue;
+		astnode *arg=NULL;
+		int nargs=0;
+		for(j=0;j<n->nitems;j++)
+		{
+			if(!n->items[j].node) continue;
+			arg=n->items[j].node;
+			nargs++;
+		}
+		switch(n->op)
+		{
+			case 0xFA: // IF: the rest of the line might not run, so it always falls through
+				if(arg&&(arg->type==AST_BLOCK))
+					dl_walk(arg, bas, s, work, nwork, computed);
+				return(true);
+			case 0xEC: // GO TO
+			case 0xED: // GO SUB
+			case 0xF7: // RUN
+				if(!nargs&&(n->op==0xF7))
+					dl_push(work, nwork, s, dl_first(bas, 0));
+				else if((nargs==1)&&(arg->type==AST_LABEL)) // followed by the line's label references
+					;
+				else if((nargs==1)&&(arg->type==AST_NUM)&&(bas->renum!=1))
+					dl_push(work, nwork, s, dl_number(bas, zxvalue(arg->items[0].tok.data2)));
+				else
+					*computed=true;
+				if(n->op!=0xED) // GO SUB comes back
+					return(false);
+			break;
+			case 0xFE: // RETURN
+			case 0xE6: // NEW
+				return(false);
+			case 0xE8: // CONTINUE goes back to wherever the last error was
+				*computed=true;
+			break;
+		}
+	}
+	return(true);
+}
+
+int opt_deadlines(int *nsegs, segment **data, __attribute__((unused)) char **inbas) // remove the lines no path through the program reaches
+{
+	int i, j, k, nwork=0;
+	lineref *work=NULL;
+	bool **live=(bool **)calloc(*nsegs, sizeof(bool *)), *all=(bool *)calloc(*nsegs, sizeof(bool));
+	for(i=0;i<*nsegs;i++) // the roots: where each program starts, and lines that the ROM searches for
+	{
+		if((*data)[i].type!=BASIC) continue;
+		bas_seg *bas=&(*data)[i].data.bas;
+		live[i]=(bool *)calloc(bas->nlines, sizeof(bool));
+		if((bas->ovstart>=0)||(bas->ovparent>=0)) // overlays are entered through their loader
+			all[i]=true;
+		dl_push(&work, &nwork, i, dl_first(bas, 0));
+		if(bas->line>0)
+			dl_push(&work, &nwork, i, dl_number(bas, bas->line));
+		else if(bas->line<0)
+		{
+			lineref at;
+			if(dl_label(*nsegs, *data, bas->lline, &at))
+				dl_push(&work, &nwork, at.seg, at.line);
+		}
+		for(j=0;j<bas->nlines;j++)
+		{
+			for(k=0;k<bas->basic[j].ntok;k++)
+			{
+				unsigned char tok=bas->basic[j].tok[k].tok;
+				if(all[i]||(tok==0xE4)||(tok==0xCE)) // DATA (for READ), DEF FN (for FN)
+				{
+					dl_push(&work, &nwork, i, j);
+					break;
+				}
+			}
+		}
+	}
+	while(nwork)
+	{
+		lineref r=work[--nwork];
+		if(live[r.seg][r.line]) continue;
+		live[r.seg][r.line]=true;
+		bas_seg *bas=&(*data)[r.seg].data.bas;
+		basline *b=&bas->basic[r.line];
+		bool computed=false;
+		for(k=0;k<b->ntok;k++) // anything a label names might be jumped to or used
+		{
+			if(((b->tok[k].tok!=TOKEN_LABEL)&&(b->tok[k].tok!=TOKEN_PTRLBL))||!b->tok[k].data) continue;
+			lineref at;
+			if(!dl_label(*nsegs, *data, b->tok[k].data, &at))
+				continue; // the linker will complain
+			if((b->tok[k].tok==TOKEN_LABEL)&&b->tok[k].index)
+			{
+				bas_seg *lb=&(*data)[at.seg].data.bas;
+				if(lb->renum==1)
+					computed=true;
+				else
+					at.line=dl_number(lb, lb->basic[at.line].number+b->tok[k].index);
+			}
+			dl_push(&work, &nwork, at.seg, at.line);
+		}
+		astnode *ast=ast_parse(b);
+		if(dl_walk(ast, bas, r.seg, &work, &nwork, &computed))
+			dl_push(&work, &nwork, r.seg, dl_first(bas, r.line+1));
+		ast_free(ast);
+		if(computed&&!all[r.seg])
+		{
+			fprintf(stderr, "bast: dead-lines: %s has a jump bast can't follow, so all its lines are kept\n\t"LOC"\n", (*data)[r.seg].name, (*data)[r.seg].name, r.line);
+			all[r.seg]=true;
+			for(j=0;j<bas->nlines;j++)
+				dl_push(&work, &nwork, r.seg, dl_first(bas, j));
+		}
+	}
+	for(i=0;i<*nsegs;i++)
+	{
+		if((*data)[i].type!=BASIC) continue;
+		bas_seg *bas=&(*data)[i].data.bas;
+		int count=0, bytes=0;
+		for(j=0;j<bas->nlines;j++)
+		{
+			if(!bas->basic[j].ntok||live[i][j]) continue;
+			if(debug) fprintf(stderr, "bast: dead-lines: removing %s\n\t"LOC"\n", bas->basic[j].text, (*data)[i].name, j);
+			bytes+=5; // line number, length and ENTER
+			for(k=0;k<bas->basic[j].ntok;k++)
+				bytes+=toksize(&bas->basic[j].tok[k]);
+			free(bas->basic[j].tok);
+			bas->basic[j].tok=NULL;
+			bas->basic[j].ntok=0;
+			bas->blines--;
+			count++;
+		}
+		if(count)
+			fprintf(stderr, "bast: dead-lines: %s: removed %u unreachable lines (%u bytes)\n", (*data)[i].name, count, bytes);
+		free(live[i]);
+	}
+	free(live);
+	free(all);
+	free(work);
+	return(0);
+}
+
+bool *ml_targets(bas_seg *bas) // which lines something can jump to: labelled lines, and the targets of constant line numbers; NULL if there's a jump bast can't follow
+{
+	int j, k;
+	bool *target=(bool *)calloc(bas->nlines, sizeof(bool)), computed=false;
+	bool label=true; // the first line is a target too
+	for(j=0;j<bas->nlines;j++) // labelled lines, and the targets of constant line numbers
+	{
+		basline *b=&bas->basic[j];
+		if(!b->ntok)
+		{
+			if(*b->text=='.')
+				label=true;
+			continue;
+		}
+		target[j]|=label;
+		label=false;
+		for(k=0;k<b->ntok;k++)
+		{
+			unsigned char tok=b->tok[k].tok;
+			if((tok==TOKEN_LABEL)&&b->tok[k].index) // reaches a line by number
+				computed=true;
+			if((tok!=0xEC)&&(tok!=0xED)&&(tok!=0xF7)&&(tok!=0xE5)&&(tok!=0xF0)&&(tok!=0xE1)) // GO TO, GO SUB, RUN, RESTORE, LIST, LLIST
+				continue;
+			bool end=(k+1>=b->ntok)||(b->tok[k+1].tok==':');
+			bool one=!end&&((k+2>=b->ntok)||(b->tok[k+2].tok==':'));
+			if(end&&(tok!=0xEC)&&(tok!=0xED)) // eg. RUN: the first line
+				continue;
+			if(one&&(b->tok[k+1].tok==TOKEN_LABEL))
+				continue;
+			if(one&&(b->tok[k+1].tok==TOKEN_ZXFLOAT)&&(bas->renum!=1))
+			{
+				int t=dl_number(bas, zxvalue(b->tok[k+1].data2));
+				if(t>=0)
+					target[t]=true;
+				continue;
+			}
+			if(!one||(b->tok[k+1].tok!=TOKEN_ZXFLOAT)) // a renumbered program's constants are wrong anyway
+				computed=true;
+		}
+	}
+	if(bas->line>0)
+	{
+		int t=dl_number(bas, bas->line);
+		if(t>=0)
+			target[t]=true;
+	}
+	if(computed)
+	{
+		free(target);
+		return(NULL);
+	}
+	return(target);
+}
+
+int ml_size(basline *b) // size of a line's statements
+{
+	int k, size=0;
+	for(k=0;k<b->ntok;k++)
+		size+=toksize(&b->tok[k]);
+	return(size);
+}
+
+bool ml_ends(basline *b) // whether nothing can be put after the line's statements: IF's condition would cover it, REM would swallow it
+{
+	int k;
+	for(k=0;k<b->ntok;k++)
+		if((b->tok[k].tok==0xFA)||(b->tok[k].tok==0xEA)||(b->tok[k].tok==TOKEN_RLINK)||(b->tok[k].tok==TOKEN_LOADER))
+			return(true);
+	return(false);
+}
+
+int ml_loop(bas_seg *bas, bool *target, int j) // if line j starts a FOR loop that could be one line on its own, that line's size; else -1
+{
+	int k, m, prev=j, size=-1;
+	basline *b=&bas->basic[j];
+	for(k=0;(k<b->ntok-1)&&(b->tok[k].tok!=0xEB);k++);
+	if((k>=b->ntok-1)||(b->tok[k+1].tok!=TOKEN_VAR))
+		return(-1);
+	char *var=b->tok[k+1].data;
+	for(m=j;m<bas->nlines;m++)
+	{
+		basline *l=&bas->basic[m];
+		if(!l->ntok)
+		{
+			if(*l->text=='.') // a label
+				return(-1);
+			continue;
+		}
+		if((m>j)&&(target[m]||ml_ends(&bas->basic[prev])))
+			return(-1);
+		size+=ml_size(l)+1;
+		if(size>MERGELEN)
+			return(-1);
+		for(k=0;k<l->ntok-1;k++)
+			if((l->tok[k].tok==0xF3)&&(l->tok[k+1].tok==TOKEN_VAR)&&!strcasecmp(l->tok[k+1].data, var)) // its NEXT
+				return((m>j)?size:-1);
+		prev=m;
+	}
+	return(-1);
+}
+
+int opt_merge(int *nsegs, segment **data, __attribute__((unused)) char **inbas) // join lines with ':' where nothing jumps to the second
+{
+	int i, j;
+	for(i=0;i<*nsegs;i++)
+	{
+		if((*data)[i].type!=BASIC) continue;
+		bas_seg *bas=&(*data)[i].data.bas;
+		if((bas->ovstart>=0)||(bas->ovparent>=0)) // the overlay loader jumps by number
+			continue;
+		bool *target=ml_targets(bas);
+		if(!target)
+		{
+			fprintf(stderr, "bast: merge-lines: not merging %s, as it has a jump bast can't follow\n", (*data)[i].name);
+			continue;
+		}
+		int cur=-1, count=0, size=0;
+		for(j=0;j<bas->nlines;j++)
+		{
+			basline *b=&bas->basic[j];
+			if(!b->ntok) continue;
+			int s=ml_size(b);
+			if((cur<0)||target[j]||ml_ends(&bas->basic[cur])||(b->tok[0].tok==TOKEN_RLINK)||(b->tok[0].tok==TOKEN_LOADER)||(size+1+s>MERGELEN))
+			{
+				cur=j;
+				size=s;
+				continue;
+			}
+			int loop=ml_loop(bas, target, j);
+			if((loop>=0)&&(size+1+loop>MERGELEN)) // start a new line, so the FOR and its NEXT are on one line
+			{
+				cur=j;
+				size=s;
+				continue;
+			}
+			basline *c=&bas->basic[cur];
+			c->tok=(token *)realloc(c->tok, (c->ntok+1+b->ntok)*sizeof(token));
+			c->tok[c->ntok++]=mktok(':');
+			memcpy(c->tok+c->ntok, b->tok, b->ntok*sizeof(token));
+			c->ntok+=b->ntok;
+			free(b->tok);
+			b->tok=NULL;
+			b->ntok=0;
+			bas->blines--;
+			size+=1+s;
+			count++;
+		}
+		if(count)
+			fprintf(stderr, "bast: merge-lines: %s: merged %u lines into the ones before them, saving %u bytes\n", (*data)[i].name, count, count*4);
+		free(target);
+	}
+	return(0);
+}
+
+int opt_striprem(int *nsegs, segment **data, __attribute__((unused)) char **inbas) // remove comments
+{
+	int i, j, k, nptrs=0;
+	char **ptrs=NULL; // labels whose lines' addresses are taken, so whose REMs may hold code or data
+	for(i=0;i<*nsegs;i++)
+	{
+		if((*data)[i].type!=BASIC) continue;
+		bas_seg *bas=&(*data)[i].data.bas;
+		for(j=0;j<bas->nlines;j++)
+		{
+			for(k=0;k<bas->basic[j].ntok;k++)
+			{
+				if((bas->basic[j].tok[k].tok!=TOKEN_PTRLBL)||!bas->basic[j].tok[k].data) continue;
+				ptrs=(char **)realloc(ptrs, ++nptrs*sizeof(char *));
+				ptrs[nptrs-1]=bas->basic[j].tok[k].data;
+			}
+		}
+	}
+	for(i=0;i<*nsegs;i++)
+	{
+		if((*data)[i].type!=BASIC) continue;
+		bas_seg *bas=&(*data)[i].data.bas;
+		int count=0, bytes=0;
+		bool pinned=false;
+		for(j=0;j<bas->nlines;j++)
+		{
+			basline *b=&bas->basic[j];
+			if(!b->ntok) // a label moves on to the next line by itself, if its line is removed
+			{
+				if(*b->text=='.')
+					for(k=0;k<nptrs;k++)
+						if(!strcmp(b->text+1, ptrs[k]))
+							pinned=true;
+				continue;
+			}
+			if(pinned)
+			{
+				pinned=false;
+				continue;
+			}
+			int r;
+			for(r=0;(r<b->ntok)&&(b->tok[r].tok!=0xEA);r++);
+			if((r==b->ntok)||b->tok[r].dl) // no REM, or one holding an object file's code
+				continue;
+			if(!r&&(bas->ovparent<0)) // a REM line: GO TO its number now reaches the next line, as it did by falling through
+			{
+				bytes+=ml_size(b)+5;
+				free(b->tok);
+				b->tok=NULL;
+				b->ntok=0;
+				bas->blines--;
+			}
+			else if(r&&(b->tok[r-1].tok==':')) // a trailing REM
+			{
+				for(k=r-1;k<b->ntok;k++)
+					bytes+=toksize(&b->tok[k]);
+				b->ntok=r-1;
+			}
+			else if(b->tok[r].data&&*b->tok[r].data) // eg. THEN REM, which needs a statement; or a REM line in an overlay, which must keep its number to overwrite the last overlay's line when it is MERGEd
+			{
+				bytes+=toksize(&b->tok[r])-1;
+				free(b->tok[r].data);
+				b->tok[r].data=strdup("");
+			}
+			else
+				continue;
+			count++;
+		}
+		if(count)
+			fprintf(stderr, "bast: strip-rem: %s: removed %u comments (%u bytes)\n", (*data)[i].name, count, bytes);
+	}
+	free(ptrs);
+	return(0);
+}
+
+int lb_cmp(const void *a, const void *b) // most executions per line first; ties keep their order
+{
+	const lblock *x=a, *y=b;
+	double dx=x->nreal?x->weight/x->nreal:0, dy=y->nreal?y->weight/y->nreal:0;
+	if(dx!=dy)
+		return((dx<dy)?1:-1);
+	return(x->start-y->start);
+}
+
+int opt_layout(int *nsegs, segment **data, __attribute__((unused)) char **inbas) // reorder labelled blocks so the most executed come first
+{
+	if(!profile)
+	{
+		fprintf(stderr, "bast: layout: no --profile given, so nothing to do\n");
+		return(0);
+	}
+	int i, j, k;
+	for(i=0;i<*nsegs;i++)
+	{
+		if((*data)[i].type!=BASIC) continue;
+		bas_seg *bas=&(*data)[i].data.bas;
+		if((bas->renum!=1)||(bas->ovstart>=0)||(bas->ovparent>=0)) // only renumbered lines can move
+			continue;
+		int dnum=renumstep(bas);
+		if(!dnum)
+			continue; // the linker will complain
+		FILE *fp=fopen(profile, "r");
+		if(!fp)
+		{
+			fprintf(stderr, "bast: layout: could not open profile %s\n", profile);
+			return(1);
+		}
+		double *count=(double *)calloc(10000, sizeof(double)); // by line number
+		char pl[256];
+		while(fgets(pl, sizeof(pl), fp)) // [segment:]line count
+		{
+			char seg[256];
+			int line;
+			double c;
+			if((*pl=='#')||(*pl=='\n')) continue;
+			if(sscanf(pl, "%255[^:\n ]:%d %lf", seg, &line, &c)==3)
+			{
+				if(strcmp(seg, (*data)[i].name)) continue;
+			}
+			else if(sscanf(pl, "%d %lf", &line, &c)!=2)
+			{
+				fprintf(stderr, "bast: layout: bad line in profile %s: %s", profile, pl);
+				continue;
+			}
+			if((line>=0)&&(line<10000))
+				count[line]+=c;
+		}
+		fclose(fp);
+		int nblocks=0, num=bas->rnstart?bas->rnstart:dnum;
+		lblock *blocks=NULL;
+		bool bad=false;
+		for(j=0;j<bas->nlines;j++) // split into blocks at the labels, numbering the lines as the linker would
+		{
+			basline *b=&bas->basic[j];
+			if(!j||(!b->ntok&&(*b->text=='.')))
+			{
+				blocks=(lblock *)realloc(blocks, ++nblocks*sizeof(lblock));
+				blocks[nblocks-1]=(lblock){j, j, 0, 0, false, true};
+			}
+			lblock *l=&blocks[nblocks-1];
+			l->end=j+1;
+			if(!b->ntok) continue;
+			l->nreal++;
+			if(num<10000) // past 9999 (from a high #pragma renum start) the linker will complain anyway
+				l->weight+=count[num];
+			num+=dnum;
+			for(k=0;k<b->ntok;k++)
+			{
+				if(b->tok[k].tok==0xE4) // DATA
+					l->data=true;
+				if((b->tok[k].tok==TOKEN_LABEL)&&b->tok[k].index) // reaches a line by number
+					bad=true;
+			}
+			int nwork=0;
+			lineref *work=NULL;
+			bool computed=false;
+			astnode *ast=ast_parse(b);
+			l->falls=dl_walk(ast, bas, i, &work, &nwork, &computed);
+			ast_free(ast);
+			free(work);
+		}
+		free(count);
+		if(bad||(nblocks<3))
+		{
+			if(bad)
+				fprintf(stderr, "bast: layout: not moving lines in %s, as it refers to lines by %%label+n\n", (*data)[i].name);
+			free(blocks);
+			continue;
+		}
+		int last=blocks[nblocks-1].falls?nblocks-1:nblocks; // the first block stays first; the last stays last if the program ends by running off it
+		lblock *order=(lblock *)malloc(nblocks*sizeof(lblock));
+		memcpy(order, blocks, nblocks*sizeof(lblock));
+		qsort(order+1, last-1, sizeof(lblock), lb_cmp);
+		for(j=1,k=1;j<last;j++) // DATA blocks take the places they were sorted into, but in their old order, so READ sees the same items
+		{
+			if(!order[j].data) continue;
+			while(!blocks[k].data)
+				k++;
+			order[j]=blocks[k++];
+		}
+		double before=0, after=0, lines=0; // executions times the lines searched past to reach them
+		for(j=0;j<nblocks;j++)
+		{
+			before+=blocks[j].weight*lines;
+			lines+=blocks[j].nreal;
+		}
+		int moved=0, nnew=0, gotos=0;
+		basline *nb=NULL;
+		lines=0;
+		for(j=0;j<nblocks;j++)
+		{
+			lblock *l=&order[j];
+			if(l->start!=blocks[j].start)
+				moved++;
+			after+=l->weight*lines;
+			lines+=l->nreal;
+			nb=(basline *)realloc(nb, (nnew+l->end-l->start+1)*sizeof(basline));
+			memcpy(nb+nnew, bas->basic+l->start, (l->end-l->start)*sizeof(basline));
+			nnew+=l->end-l->start;
+			for(k=0;(k<nblocks-1)&&(blocks[k].start!=l->start);k++);
+			if((k<nblocks-1)&&blocks[k].falls&&((j==nblocks-1)||(order[j+1].start!=blocks[k+1].start))) // it fell into the next block, which is now elsewhere
+			{
+				basline *g=&bas->basic[blocks[k+1].start];
+				basline *n=&nb[nnew++];
+				n->sline=g->sline;
+				n->number=0;
+				n->text=(char *)malloc(strlen(g->text)+8);
+				sprintf(n->text, "GO TO %%%s", g->text+1);
+				n->ntok=2;
+				n->tok=(token *)malloc(2*sizeof(token));
+				n->tok[0]=mktok(0xEC);
+				n->tok[1]=mktok(TOKEN_LABEL);
+				n->tok[1].data=strdup(g->text+1);
+				n->tok[1].index=0;
+				n->tok[1].dl=0;
+				n->offset=0;
+				lines++;
+				gotos++;
+				bas->blines++;
+			}
+		}
+		if(!moved)
+		{
+			free(nb);
+			free(order);
+			free(blocks);
+			continue;
+		}
+		free(bas->basic);
+		bas->basic=nb;
+		bas->nlines=nnew;
+		fprintf(stderr, "bast: layout: %s: moved %u of %u blocks, adding %u GO TOs; estimated line-search cost %.0f -> %.0f lines (%+.1f%%)\n", (*data)[i].name, moved, nblocks, gotos, before, after, before?(after-before)*100/before:0);
+		free(order);
+		free(blocks);
+	}
+	return(0);
+}
+
+const char *pp_builtin[]= // the rules -O peephole always has; --rules adds more, in the same form
+{
+	"GO TO {next}{eol} ->", // the next line comes next anyway
+	"GO SUB {e1}: RETURN -> GO TO {e1}", // its RETURN can come straight back here
+	"IF 1 THEN ->",
+	"LET {e1}={e1}+0 ->",
+	"LET {e1}={e1}-0 ->",
+	"LET {e1}={e1}*1 ->",
+	"LET {e1}={e1}/1 ->",
+	"PRINT \"\"; ->", // prints nothing, and leaves the position where it was
+	"INK {n1}: INK {n2} -> INK {n2}",
+	"PAPER {n1}: PAPER {n2} -> PAPER {n2}",
+	"BORDER {n1}: BORDER {n2} -> BORDER {n2}",
+};
+
+int pp_parse(char *text, pedge **out, char *where) // turn one side of a rule into steps; -1 on error
+{
+	int n=0;
+	*out=NULL;
+	while(*text)
+	{
+		while(isspace(*text))
+			text++;
+		if(!*text)
+			break;
+		if(*text=='{') // a wildcard
+		{
+			char *e=strchr(text, '}');
+			if(!e)
+			{
+				fprintf(stderr, "bast: peephole: missing '}'\n\t%s\n", where);
+				return(-1);
+			}
+			pedge p={PK_TOK, mktok(0), 0, 0, -1};
+			if((e-text==3)&&strchr("en", text[1])&&(text[2]>='1')&&(text[2]<='9'))
+			{
+				p.kind=(text[1]=='e')?PK_EXPR:PK_NUM;
+				p.slot=text[2]-'1';
+			}
+			else if(!strncmp(text, "{next}", 6))
+				p.kind=PK_NEXT;
+			else if(!strncmp(text, "{eol}", 5))
+				p.kind=PK_EOL;
+			else
+			{
+				fprintf(stderr, "bast: peephole: unknown wildcard %.*s\n\t%s\n", (int)(e-text+1), text, where);
+				return(-1);
+			}
+			*out=(pedge *)realloc(*out, ++n*sizeof(pedge));
+			(*out)[n-1]=p;
+			text=e+1;
+			continue;
+		}
+		char *e=text; // BASIC, up to the next wildcard; the tokeniser does the work
+		bool quote=false;
+		while(*e&&(quote||(*e!='{')))
+		{
+			if(*e=='"')
+				quote=!quote;
+			e++;
+		}
+		basline b={0, 0, strndup(text, e-text), 0, NULL, 0};
+		err=false;
+		tokenise(&b, &where, 0, 1);
+		free(b.text);
+		if(err)
+			return(-1);
+		*out=(pedge *)realloc(*out, (n+b.ntok)*sizeof(pedge));
+		int i;
+		for(i=0;i<b.ntok;i++)
+			(*out)[n++]=(pedge){PK_TOK, b.tok[i], 0, 0, -1};
+		free(b.tok);
+		text=e;
+	}
+	int i;
+	for(i=0;i<n-1;i++)
+		if(((*out)[i].kind==PK_EXPR)&&((*out)[i+1].kind==PK_TOK))
+			(*out)[i].rbp=ast_binprio((*out)[i+1].tok.tok);
+	return(n);
+}
+
+int pp_add(pnode **trie, int *nnodes, pedge *pat, int npat, int rule) // add a pattern to the trie, sharing any prefix it has with those already there
+{
+	int node=0, i, k;
+	for(i=0;i<npat;i++)
+	{
+		pnode *n=&(*trie)[node];
+		for(k=0;k<n->nedges;k++)
+		{
+			pedge *e=&n->edges[k];
+			if((e->kind==pat[i].kind)&&(e->slot==pat[i].slot)&&(e->rbp==pat[i].rbp)&&((e->kind!=PK_TOK)||pp_same(&e->tok, &pat[i].tok)))
+				break;
+		}
+		if(k==n->nedges)
+		{
+			*trie=(pnode *)realloc(*trie, ++*nnodes*sizeof(pnode));
+			(*trie)[*nnodes-1]=(pnode){0, NULL, -1};
+			n=&(*trie)[node];
+			n->edges=(pedge *)realloc(n->edges, ++n->nedges*sizeof(pedge));
+			n->edges[k]=pat[i];
+			n->edges[k].next=*nnodes-1;
+		}
+		node=n->edges[k].next;
+	}
+	if((*trie)[node].rule>=0)
+		return(-1);
+	(*trie)[node].rule=rule;
+	return(0);
+}
+
+int pp_rule(pnode **trie, int *nnodes, prule **rules, int *nrules, char *text, char *where) // compile a rule 'pattern -> replacement'
+{
+	char *arrow=strstr(text, "->");
+	if(!arrow)
+	{
+		fprintf(stderr, "bast: peephole: rule has no '->'\n\t%s\n", where);
+		return(1);
+	}
+	char *lhs=strndup(text, arrow-text);
+	pedge *pat, *rep;
+	int npat=pp_parse(lhs, &pat, where), nrep=pp_parse(arrow+2, &rep, where), i;
+	free(lhs);
+	if((npat<0)||(nrep<0))
+		return(1);
+	if(!npat)
+	{
+		fprintf(stderr, "bast: peephole: rule has an empty pattern\n\t%s\n", where);
+		return(1);
+	}
+	for(i=0;i<nrep;i++)
+	{
+		if(rep[i].kind==PK_NEXT||rep[i].kind==PK_EOL)
+		{
+			fprintf(stderr, "bast: peephole: {next} and {eol} can only be matched, not replaced\n\t%s\n", where);
+			return(1);
+		}
+		int k;
+		for(k=0;(k<npat)&&!((pat[k].kind==rep[i].kind)&&(pat[k].slot==rep[i].slot));k++);
+		if((rep[i].kind!=PK_TOK)&&(k==npat))
+		{
+			fprintf(stderr, "bast: peephole: replacement uses a wildcard the pattern doesn't match\n\t%s\n", where);
+			return(1);
+		}
+	}
+	*rules=(prule *)realloc(*rules, ++*nrules*sizeof(prule));
+	(*rules)[*nrules-1]=(prule){strdup(text), nrep, rep, 0};
+	if(pp_add(trie, nnodes, pat, npat, *nrules-1))
+		fprintf(stderr, "bast: peephole: Warning: pattern already has a rule; ignoring this one\n\t%s\n", where);
+	free(pat);
+	return(0);
+}
+
+bool pp_same(const token *a, const token *b) // whether two tokens are the same
+{
+	if(a->tok!=b->tok)
+		return(false);
+	switch(a->tok)
+	{
+		case TOKEN_ZXFLOAT:
+			return(!memcmp(a->data2, b->data2, 5));
+		case TOKEN_VAR:
+		case TOKEN_VARSTR:
+			return(!strcasecmp(a->data, b->data));
+		case TOKEN_STRING:
+		case 0xEA: // REM
+			return(!strcmp(a->data?a->data:"", b->data?b->data:""));
+		case TOKEN_LABEL:
+		case TOKEN_PTRLBL:
+			return(a->data&&b->data&&!strcmp(a->data, b->data)&&(a->index==b->index));
+		default:
+			return(true);
+	}
+}
+
+bool pp_next(bas_seg *bas, int j, const token *t) // whether t names the line after line j
+{
+	int n=dl_first(bas, j+1), k;
+	if(n<0)
+		return(false);
+	if((t->tok==TOKEN_LABEL)&&t->data&&!t->index)
+	{
+		for(k=j+1;k<n;k++)
+			if((*bas->basic[k].text=='.')&&!strcmp(bas->basic[k].text+1, t->data))
+				return(true);
+		return(false);
+	}
+	return((t->tok==TOKEN_ZXFLOAT)&&(bas->renum!=1)&&(dl_number(bas, zxvalue(t->data2))==n));
+}
+
+int pp_match(pnode *trie, int node, bas_seg *bas, int j, int pos, int *bs, int *be, int *end) // the rule matching at pos from this trie node, or -1; longer patterns win
+{
+	basline *b=&bas->basic[j];
+	int k, r, l;
+	for(k=0;k<trie[node].nedges;k++)
+	{
+		pedge *e=&trie[node].edges[k];
+		switch(e->kind)
+		{
+			case PK_TOK:
+				if((pos<b->ntok)&&pp_same(&b->tok[pos], &e->tok)&&((r=pp_match(trie, e->next, bas, j, pos+1, bs, be, end))>=0))
+					return(r);
+			break;
+			case PK_NEXT:
+				if((pos<b->ntok)&&pp_next(bas, j, &b->tok[pos])&&((r=pp_match(trie, e->next, bas, j, pos+1, bs, be, end))>=0))
+					return(r);
+			break;
+			case PK_EOL:
+				if((pos==b->ntok)&&((r=pp_match(trie, e->next, bas, j, pos, bs, be, end))>=0))
+					return(r);
+			break;
+			case PK_NUM:
+			case PK_EXPR:
+				if(be[e->slot]>=0) // bound already: the same tokens again
+				{
+					int len=be[e->slot]-bs[e->slot];
+					if(pos+len>b->ntok) break;
+					for(l=0;(l<len)&&pp_same(&b->tok[pos+l], &b->tok[bs[e->slot]+l]);l++);
+					if((l==len)&&((r=pp_match(trie, e->next, bas, j, pos+len, bs, be, end))>=0))
+						return(r);
+					break;
+				}
+				if(e->kind==PK_NUM)
+					l=((pos<b->ntok)&&(b->tok[pos].tok==TOKEN_ZXFLOAT))?1:0;
+				else
+				{
+					astparser p={b->tok, b->ntok, pos};
+					astnode *x=ast_expr(&p, e->rbp);
+					l=x?p.i-pos:0;
+					if(x)
+						ast_free(x);
+				}
+				if(!l) break;
+				bs[e->slot]=pos;
+				be[e->slot]=pos+l;
+				if((r=pp_match(trie, e->next, bas, j, pos+l, bs, be, end))>=0)
+					return(r);
+				be[e->slot]=-1;
+			break;
+		}
+	}
+	if((trie[node].rule>=0)&&((pos==b->ntok)||(b->tok[pos].tok==':')||(pos&&(b->tok[pos-1].tok==0xCB)))) // a whole statement (or statements), or up to THEN
+	{
+		*end=pos;
+		return(trie[node].rule);
+	}
+	return(-1);
+}
+
+int pp_span(pnode *trie, int node) // the most statements a pattern from this trie node covers
+{
+	int k, most=1;
+	for(k=0;k<trie[node].nedges;k++)
+	{
+		pedge *e=&trie[node].edges[k];
+		int s=pp_span(trie, e->next);
+		if((e->kind==PK_TOK)&&((e->tok.tok==':')||(e->tok.tok==0xCB)))
+			s++;
+		most=max(most, s);
+	}
+	return(most);
+}
+
+int opt_peephole(int *nsegs, segment **data, __attribute__((unused)) char **inbas) // rewrite statements matching the rules' patterns
+{
+	int nnodes=1, nrules=0, i, j, k;
+	pnode *trie=(pnode *)malloc(sizeof(pnode));
+	trie[0]=(pnode){0, NULL, -1};
+	prule *rules=NULL;
+	char where[64];
+	for(i=0;i<(int)(sizeof(pp_builtin)/sizeof(*pp_builtin));i++)
+	{
+		sprintf(where, "built-in rule %u", i+1);
+		if(pp_rule(&trie, &nnodes, &rules, &nrules, (char *)pp_builtin[i], where))
+			return(1);
+	}
+	if(rulefile)
+	{
+		FILE *fp=fopen(rulefile, "r");
+		if(!fp)
+		{
+			fprintf(stderr, "bast: peephole: could not open rule file %s\n", rulefile);
+			return(1);
+		}
+		char rl[1024];
+		int n=0;
+		while(fgets(rl, sizeof(rl), fp))
+		{
+			n++;
+			char *nl=strchr(rl, '\n');
+			if(nl)
+				*nl=0;
+			char *p=rl;
+			while(isspace(*p))
+				p++;
+			if(!*p||(*p=='#')) continue;
+			snprintf(where, sizeof(where), "%.48s:%u", rulefile, n);
+			if(pp_rule(&trie, &nnodes, &rules, &nrules, p, where))
+			{
+				fclose(fp);
+				return(1);
+			}
+		}
+		fclose(fp);
+	}
+	int span=pp_span(trie, 0);
+	for(i=0;i<*nsegs;i++)
+	{
+		if((*data)[i].type!=BASIC) continue;
+		bas_seg *bas=&(*data)[i].data.bas;
+		int count=0, saved=0;
+		for(j=0;j<bas->nlines;j++)
+		{
+			basline *b=&bas->basic[j];
+			int pos, tries=0;
+			for(pos=0;(pos<b->ntok)&&(tries<64);pos++)
+			{
+				if(pos&&(b->tok[pos-1].tok!=':')&&(b->tok[pos-1].tok!=0xCB)) continue; // statements start a line, or follow ':' or THEN
+				int bs[9], be[9], end;
+				for(k=0;k<9;k++)
+					be[k]=-1;
+				int r=pp_match(trie, 0, bas, j, pos, bs, be, &end);
+				if(r<0) continue;
+				prule *ru=&rules[r];
+				int before=ml_size(b);
+				token *nt=NULL;
+				int nn=0;
+				for(k=0;k<pos;k++) // the line up to the match
+				{
+					nt=(token *)realloc(nt, (nn+1)*sizeof(token));
+					nt[nn++]=b->tok[k];
+				}
+				for(k=0;k<ru->nrep;k++) // the replacement, with the wildcards' tokens
+				{
+					pedge *e=&ru->rep[k];
+					int from=(e->kind==PK_TOK)?-1:bs[e->slot], to=(e->kind==PK_TOK)?0:be[e->slot], l;
+					if(e->kind==PK_TOK)
+					{
+						nt=(token *)realloc(nt, (nn+1)*sizeof(token));
+						nt[nn]=e->tok;
+						if(e->tok.data)
+							nt[nn].data=strdup(e->tok.data);
+						nn++;
+					}
+					for(l=from;(l>=0)&&(l<to);l++)
+					{
+						nt=(token *)realloc(nt, (nn+1)*sizeof(token));
+						nt[nn++]=b->tok[l];
+					}
+				}
+				int rest=end;
+				if(!ru->nrep) // removing the statement: lose a ':' with it, or leave a REM for THEN (or the line) to have a statement
+				{
+					if((rest<b->ntok)&&(b->tok[rest].tok==':'))
+						rest++;
+					else if((rest==b->ntok)&&nn&&(nt[nn-1].tok==':'))
+						nn--;
+					else if((rest==b->ntok)&&(!nn||(nt[nn-1].tok==0xCB)))
+					{
+						nt=(token *)realloc(nt, (nn+1)*sizeof(token));
+						nt[nn]=mktok(0xEA);
+						nt[nn++].data=strdup("");
+					}
+				}
+				for(k=rest;k<b->ntok;k++) // and the rest of the line
+				{
+					nt=(token *)realloc(nt, (nn+1)*sizeof(token));
+					nt[nn++]=b->tok[k];
 				}
+				if(debug) fprintf(stderr, "bast: peephole: %s\n\t"LOC"\n", ru->text, (*data)[i].name, j);
+				free(b->tok);
+				b->tok=nt;
+				b->ntok=nn;
+				ru->uses++;
+				count++;
+				saved+=before-ml_size(b);
+				for(k=0;(k<span)&&pos;k++) // back to the earliest statement whose match the rewrite may have changed (a removal can leave the one before at {eol})
+					for(pos--;pos&&(b->tok[pos-1].tok!=':')&&(b->tok[pos-1].tok!=0xCB);pos--);
+				pos--; // and look again from there
+				tries++;
 			}
-			append_char(&line, &ll, &li, 0x0D); // 0x0D is ENTER in ZX charset
-			append_char(&bas->block, &dbl, &bas->blen, li);
-			append_char(&bas->block, &dbl, &bas->blen, li>>8);
-			for(j=0;j<li;j++)
-				append_char(&bas->block, &dbl, &bas->blen, line[j]);
-			free(line);
+			if(tries>=64)
+				fprintf(stderr, "bast: peephole: Warning: stopped after %u rewrites of one line; do the rules undo each other?\n\t"LOC"\n", tries, (*data)[i].name, j);
 		}
+		if(count)
+			fprintf(stderr, "bast: peephole: %s: made %u rewrites, saving %d bytes\n", (*data)[i].name, count, saved);
 	}
-	exit:;
+	for(i=0;i<nrules;i++)
+	{
+		if(rules[i].uses)
+			fprintf(stderr, "bast: peephole: %ux %s\n", rules[i].uses, rules[i].text);
+		free(rules[i].text);
+		free(rules[i].rep);
+	}
+	for(i=0;i<nnodes;i++)
+		free(trie[i].edges);
+	free(trie);
+	free(rules);
+	return(0);
 }
 
-void bin_load(char *fname, FILE *fp, bin_seg * buf, char **name)
+const unsigned char pd_reader[2][21]= // the USR routine -O pack-data puts before the table: BC=its address; returns the next item, and steps the offset (stored after it) on
 {
-	bool warned=false;
-	if(buf)
+	{0x60, 0x69, 0x11, 20, 0x00, 0x19, 0x5E, 0x23, 0x56, 0xD5, 0x13, 0x72, 0x2B, 0x73, 0xE1, 0x09, 0x4E, 0x06, 0x00, 0xC9}, // ld hl,bc; add hl,20; ld de,(hl); push de; inc de; ld (hl),de; pop hl; add hl,bc; ld c,(hl); ld b,0; ret
+	{0x60, 0x69, 0x11, 21, 0x00, 0x19, 0x5E, 0x23, 0x56, 0xD5, 0x13, 0x13, 0x72, 0x2B, 0x73, 0xE1, 0x09, 0x4E, 0x23, 0x46, 0xC9}, // as above, but two bytes
+};
+
+int pd_end(basline *b, int k) // the end of the statement at k (its ':', or the end of the line)
+{
+	while((k<b->ntok)&&(b->tok[k].tok!=':'))
+		k++;
+	return(k);
+}
+
+void pd_add(token **nt, int *nn, token t)
+{
+	*nt=(token *)realloc(*nt, ++*nn*sizeof(token));
+	(*nt)[*nn-1]=t;
+}
+
+void pd_restore(token **nt, int *nn, token ref, int ptr, int off) // POKE the reader's offset: POKE r+ptr,lo: POKE r+ptr+1,hi (r being a variable, or @label+1)
+{
+	int h;
+	for(h=0;h<2;h++)
 	{
-		buf->nbytes=0;
-		buf->bytes=NULL;
-		fprintf(stderr, "bast: Linker (object): reading %s\n", fname);
-		char *line=fgetl(fp);
-		int len=0;
-		int i=1;
-		while(line&&!feof(fp))
+		if(h)
+			pd_add(nt, nn, mktok(':'));
+		pd_add(nt, nn, mktok(0xF4)); // POKE
+		token r=ref;
+		if(r.tok==TOKEN_PTRLBL)
 		{
-			if(*line)
+			r.data=strdup(ref.data);
+			r.index+=ptr+h;
+			pd_add(nt, nn, r);
+		}
+		else
+		{
+			r.data=strdup(ref.data);
+			pd_add(nt, nn, r);
+			pd_add(nt, nn, mktok('+'));
+			pd_add(nt, nn, mknum(ptr+h));
+		}
+		pd_add(nt, nn, mktok(','));
+		pd_add(nt, nn, mknum(h?off>>8:off&0xFF));
+	}
+}
+
+int opt_packdata(int *nsegs, segment **data, char **inbas) // move constant DATA into a table in a REM, read by a USR routine
+{
+	int i, j, k;
+	for(i=0;i<*nsegs;i++)
+	{
+		if((*data)[i].type!=BASIC) continue;
+		bas_seg *bas=&(*data)[i].data.bas;
+		int nitems=0, *before=(int *)calloc(bas->nlines+1, sizeof(int)), first=dl_first(bas, 0), last=-1, skipped=0;
+		unsigned int *items=NULL, top=0;
+		const char *why=NULL;
+		for(j=0;(j<bas->nlines)&&!why;j++) // collect the items, and check that we can rewrite every READ and RESTORE
+		{
+			basline *b=&bas->basic[j];
+			before[j]=nitems;
+			if(b->ntok)
+				last=j;
+			for(k=0;(k<b->ntok)&&!why;k++)
 			{
-				if(*line=='@')
+				unsigned char tok=b->tok[k].tok;
+				bool start=!k||(b->tok[k-1].tok==':')||(b->tok[k-1].tok==0xCB);
+				int e=pd_end(b, k), l;
+				if(tok==0xE4) // DATA
 				{
-					sscanf(line, "@%04x", (unsigned int *)&buf->org);
+					if(k&&(b->tok[k-1].tok==0xCB))
+						why="a DATA after THEN";
+					for(l=k+1;(l<e)&&!why;l+=2)
+					{
+						double v=(b->tok[l].tok==TOKEN_ZXFLOAT)?zxvalue(b->tok[l].data2):-1;
+						if((v<0)||(v>65535)||(v!=floor(v))||((l+1<e)&&(b->tok[l+1].tok!=',')))
+							why="DATA other than whole numbers 0 to 65535";
+						else
+						{
+							items=(unsigned int *)realloc(items, ++nitems*sizeof(unsigned int));
+							items[nitems-1]=v;
+							top=max(top, v);
+						}
+					}
+					for(l=k;l<e;l++)
+						skipped+=toksize(&b->tok[l]);
+					k=e;
 				}
-				else if(*line=='#')
+				else if((tok==0xE3)&&start) // READ: numeric variables or array elements
 				{
-					if(name)
-						*name=strdup(line+1);
+					for(l=k+1;(l<e)&&!why;)
+					{
+						if(b->tok[l].tok!=TOKEN_VAR)
+							why="a READ of a string";
+						int depth=0;
+						for(l++;(l<e)&&(depth||(b->tok[l].tok!=','));l++)
+							depth+=(b->tok[l].tok=='(')-(b->tok[l].tok==')');
+						l++;
+					}
 				}
-				else if(*line=='*')
+				else if((tok==0xE5)&&start) // RESTORE, to the start or a line we know
 				{
-					sscanf(line, "*%04x", (unsigned int *)&len);
+					if((e==k+2)&&(b->tok[k+1].tok==TOKEN_LABEL)&&!b->tok[k+1].index) ;
+					else if((e==k+2)&&(b->tok[k+1].tok==TOKEN_ZXFLOAT)&&(bas->renum!=1)) ;
+					else if(e!=k+1)
+						why="a RESTORE to a line bast can't work out";
 				}
-				else
+				else if((tok==0xE3)||(tok==0xE5))
+					why="a READ or RESTORE that isn't a statement of its own";
+			}
+		}
+		before[bas->nlines]=nitems;
+		if(!nitems||!why)
+		{
+			if(!nitems)
+				why="";
+			else if((bas->ovstart>=0)||(bas->ovparent>=0))
+				why="overlays";
+			else if(bas->line)
+				why="#pragma line (so it might not start at its first line)";
+			else if(!bas->renum&&((bas->basic[first].number<=1)||(bas->basic[last].number>=9999)))
+				why="no line numbers free before its first line or after its last";
+		}
+		if(why)
+		{
+			if(*why)
+				fprintf(stderr, "bast: pack-data: not packing %s, as it has %s\n", (*data)[i].name, why);
+			free(items);
+			free(before);
+			continue;
+		}
+		bool words=(top>255), used[26];
+		int size=words?2:1, ptr=words?21:20, letter;
+		token ref;
+		char lbl[32];
+		sprintf(lbl, "packdata%u", i);
+		if(usedletters(bas, used)) // RUN and CLEAR delete variables, so use the address itself
+		{
+			ref=mktok(TOKEN_PTRLBL);
+			ref.data=strdup(lbl);
+			ref.index=1;
+		}
+		else
+		{
+			for(letter=0;(letter<26)&&used[letter];letter++);
+			if(letter==26)
+			{
+				fprintf(stderr, "bast: pack-data: not packing %s, as there's no single-letter variable free\n", (*data)[i].name);
+				free(items);
+				free(before);
+				continue;
+			}
+			ref=mktok(TOKEN_VAR);
+			ref.data=strdup("a");
+			ref.data[0]+=letter;
+		}
+		token **nts=(token **)calloc(bas->nlines, sizeof(token *));
+		int *nns=(int *)calloc(bas->nlines, sizeof(int)), blen=ptr+2+nitems*size, gain=-(blen+6); // the table's line: number, length, REM, table, newline
+		for(j=0;j<bas->nlines;j++) // rewrite DATA, READ, RESTORE (and RUN and CLEAR, which RESTORE)
+		{
+			basline *b=&bas->basic[j];
+			if(!b->ntok) continue;
+			token *nt=NULL;
+			int nn=0;
+			for(k=0;k<b->ntok;)
+			{
+				unsigned char tok=b->tok[k].tok;
+				bool start=!k||(b->tok[k-1].tok==':')||(b->tok[k-1].tok==0xCB);
+				int e=pd_end(b, k), l;
+				if(!start||((tok!=0xE4)&&(tok!=0xE3)&&(tok!=0xE5)&&(tok!=0xF7)&&(tok!=0xFD)))
 				{
-					unsigned char cksum=0;
-					char *ent=strtok(line, " \t");
-					bin_byte row[8];
-					int col;
-					for(col=0;col<8;col++)
-					{
-						if(!ent)
-						{
-							fprintf(stderr, "bast: Linker (object): Too few pairs on line\n\t%s:%u\n", fname, i);
-							err=true;
-							break;
-						}
-						if(isxdigit(ent[0])&&isxdigit(ent[1]))
-						{
-							unsigned int n;
-							sscanf(ent, "%02x", &n);
-							row[col].type=BYTE;
-							row[col].byte=n;
-							cksum^=n;
-						}
-						else if((ent[0]=='$')&&(ent[1]=='$'))
-						{
-							if((!len)||(buf->nbytes+col+1>=len))
-							{
-								row[col].type=BNONE;
-								row[col].byte=0;
-							}
-							else
-							{
-								fprintf(stderr, "bast: Linker (object): Bad pair %s (too soon)\n\t%s:%u\n", ent, fname, i);
-								err=true;
-							}
-						}
-						else
-						{
-							fprintf(stderr, "bast: Linker (object): Bad pair %s\n\t%s:%u\n", ent, fname, i);
-							err=true;
-						}
-						ent=strtok(NULL, " \t");
-					}
-					if(ent)
+					pd_add(&nt, &nn, b->tok[k++]);
+					continue;
+				}
+				if(tok==0xE4) // DATA: gone, with a ':'
+				{
+					if(e<b->ntok)
+						e++;
+					else if(nn&&(nt[nn-1].tok==':'))
+						nn--;
+					k=e;
+					continue;
+				}
+				if(tok==0xE3) // READ a,b(i) -> LET a=USR r: LET b(i)=USR r
+				{
+					for(l=k+1;l<e;)
 					{
-						if((ent[0]=='=')&&(ent[1]=='='))
-						{
-							ent=strtok(NULL, "");
-							if(ent&&isxdigit(ent[0])&&isxdigit(ent[1]))
-							{
-								unsigned int n;
-								sscanf(ent, "%02x", &n);
-								if(cksum!=n)
-								{
-									fprintf(stderr, "bast: Linker (object): Checksum failed: got %02x, expected %02x\n\t%s:%u\n", n, cksum, fname, i);
-									err=true;
-								}
-							}
-							else
-							{
-								fprintf(stderr, "bast: Linker (object): Bad pair (checksum) %s\n\t%s:%u\n", ent, fname, i);
-								err=true;
-							}
-						}
-						else
+						if(l>k+1)
+							pd_add(&nt, &nn, mktok(':'));
+						pd_add(&nt, &nn, mktok(0xF1));
+						int depth=0;
+						for(;(l<e)&&(depth||(b->tok[l].tok!=','));l++)
 						{
-							fprintf(stderr, "bast: Linker (object): Bad pair (==) %s\n\t%s:%u\n", ent, fname, i);
-							err=true;
+							depth+=(b->tok[l].tok=='(')-(b->tok[l].tok==')');
+							pd_add(&nt, &nn, b->tok[l]);
 						}
+						l++;
+						pd_add(&nt, &nn, mktok('='));
+						pd_add(&nt, &nn, mktok(0xC0)); // USR
+						token r=ref;
+						r.data=strdup(ref.data);
+						pd_add(&nt, &nn, r);
 					}
-					else if(Wobjsum&&!warned)
-					{
-						fprintf(stderr, "bast: Linker (object): Warning, checksum missing\n\t%s:%u\n", fname, i);
-						warned=true;
-					}
-					if(!err)
+					k=e;
+					continue;
+				}
+				int to=0; // RESTORE, RUN and CLEAR go back to the start; RESTORE <line> to the first item after it
+				if((tok==0xE5)&&(e==k+2))
+				{
+					int line=-1;
+					if(b->tok[k+1].tok==TOKEN_LABEL)
 					{
-						col=0;
-						while((col<8) && row[col].type!=BNONE)
-						{
-							buf->nbytes++;
-							buf->bytes=(bin_byte *)realloc(buf->bytes, buf->nbytes*sizeof(bin_byte));
-							buf->bytes[buf->nbytes-1]=row[col++];
-						}
+						lineref at;
+						if(dl_label(*nsegs, *data, b->tok[k+1].data, &at)&&(at.seg==i))
+							line=at.line;
 					}
+					else
+						line=dl_number(bas, zxvalue(b->tok[k+1].data2));
+					to=(line<0)?nitems:before[line];
+				}
+				pd_restore(&nt, &nn, ref, ptr, ptr+2+to*size);
+				if(tok!=0xE5) // RUN and CLEAR themselves
+				{
+					pd_add(&nt, &nn, mktok(':'));
+					for(;k<e;k++)
+						pd_add(&nt, &nn, b->tok[k]);
 				}
+				k=e;
+			}
+			nts[j]=nt;
+			nns[j]=nn;
+			gain+=ml_size(b)+5;
+			if(nn)
+			{
+				basline nb={.ntok=nn, .tok=nt};
+				gain-=ml_size(&nb)+5;
 			}
-			free(line);
-			line=err?NULL:fgetl(fp);
-			i++;
 		}
-		fclose(fp);
-		if(len && (len!=buf->nbytes))
+		token *nt=NULL; // and a new first line (ahead of any labels, which still mean the old one), to set the reader up as RUN would
+		int nn=0;
+		if(ref.tok==TOKEN_VAR)
 		{
-			fprintf(stderr, "bast: Linker (object): %s got bad count %u bytes of %u\n", fname, buf->nbytes, len);
-			err=true;
+			pd_add(&nt, &nn, mktok(0xF1));
+			token r=ref;
+			r.data=strdup(ref.data);
+			pd_add(&nt, &nn, r);
+			pd_add(&nt, &nn, mktok('='));
+			token p=mktok(TOKEN_PTRLBL);
+			p.data=strdup(lbl);
+			p.index=1;
+			pd_add(&nt, &nn, p);
+			pd_add(&nt, &nn, mktok(':'));
 		}
-		else if(!len && Wobjlen)
+		pd_restore(&nt, &nn, ref, ptr, ptr+2);
+		basline nb={.ntok=nn, .tok=nt};
+		gain-=ml_size(&nb)+5;
+		if(gain<=0)
 		{
-			fprintf(stderr, "bast: Linker (object): Warning, no length directive in %s\n", fname);
+			fprintf(stderr, "bast: pack-data: not packing %s, as it would cost %d bytes\n", (*data)[i].name, -gain);
+			for(j=0;j<bas->nlines;j++)
+				free(nts[j]);
+			free(nts);
+			free(nns);
+			free(nt);
+			free(items);
+			free(before);
+			continue;
+		}
+		for(j=0;j<bas->nlines;j++)
+		{
+			basline *b=&bas->basic[j];
+			if(!b->ntok) continue;
+			free(b->tok);
+			b->tok=nts[j];
+			b->ntok=nns[j];
+			if(!b->ntok) // all DATA
+				bas->blines--;
 		}
+		free(nts);
+		free(nns);
+		char *block=(char *)malloc(blen);
+		memcpy(block, pd_reader[words], ptr);
+		block[ptr]=(ptr+2)&0xFF;
+		block[ptr+1]=(ptr+2)>>8;
+		for(j=0;j<nitems;j++)
+		{
+			block[ptr+2+j*size]=items[j];
+			if(words)
+				block[ptr+3+j*size]=items[j]>>8;
+		}
+		char line[64];
+		sprintf(line, ".%s", lbl); // the table goes at the end, out of the way of line searches
+		if(addbasline(&bas->nlines, &bas->basic, line))
+		{
+			fprintf(stderr, "bast: Internal error: pack-data: failed to add line\n");
+			return(1);
+		}
+		bas->basic[bas->nlines-1].sline=bas->basic[last].sline;
+		if(bas->renum)
+			strcpy(line, "REM");
 		else
+			sprintf(line, "%u REM", bas->basic[last].number+1);
+		if(addbasline(&bas->nlines, &bas->basic, line))
 		{
-			fprintf(stderr, "bast: Linker (object): %s got %u bytes\n", fname, buf->nbytes);
+			fprintf(stderr, "bast: Internal error: pack-data: failed to add line\n");
+			return(1);
+		}
+		basline *b=&bas->basic[bas->nlines-1];
+		b->sline=bas->basic[last].sline;
+		err=false;
+		tokenise(b, inbas, bas->fbas, bas->renum);
+		if(err||(b->ntok!=1))
+		{
+			fprintf(stderr, "bast: Internal error: pack-data: failed to make the table line\n");
+			return(1);
 		}
+		free(b->tok[0].data);
+		b->tok[0].data=block;
+		b->tok[0].dl=blen;
+		bas->blines++;
+		if(addbasline(&bas->nlines, &bas->basic, ""))
+		{
+			fprintf(stderr, "bast: Internal error: pack-data: failed to add line\n");
+			return(1);
+		}
+		nb=bas->basic[bas->nlines-1];
+		memmove(bas->basic+1, bas->basic, (bas->nlines-1)*sizeof(basline));
+		nb.sline=bas->basic[first+1].sline;
+		nb.number=bas->renum?0:bas->basic[first+1].number-1;
+		nb.tok=nt;
+		nb.ntok=nn;
+		bas->basic[0]=nb;
+		bas->blines++;
+		fprintf(stderr, "bast: pack-data: %s: packed %u DATA items into a %u-byte table of %s, saving %d bytes; READ no longer steps through %u bytes of DATA\n", (*data)[i].name, nitems, blen, words?"words":"bytes", gain, skipped);
+		free(items);
+		free(before);
 	}
-	else
+	return(0);
+}
+
+const unsigned char pb_player[36]= // the player -O pack-beeps puts at '.beeps<n>', for IF USR ... THEN REM: plays the notes in the REM after the call, each as the ROM's BEEPER parameters DE,HL, until DE=0
+{
+	0x2A, 0x5D, 0x5C, // ld hl,(CH_ADD)
+	0x7E, 0x23, 0xFE, 0xEA, 0x20, 0xFA, // find: ld a,(hl); inc hl; cp REM; jr nz,find
+	0x5E, 0x23, 0x56, 0x23, 0x7A, 0xB3, 0x28, 0x12, // next: ld e,(hl); inc hl; ld d,(hl); inc hl; ld a,d; or e; jr z,done
+	0x4E, 0x23, 0x46, 0x23, 0xE5, 0x60, 0x69, // ld c,(hl); inc hl; ld b,(hl); inc hl; push hl; ld h,b; ld l,c
+	0xCD, 0xB5, 0x03, // call BEEPER
+	0xCD, 0x54, 0x1F, 0xE1, 0x38, 0xE8, // call BREAK-KEY; pop hl; jr c,next
+	0xCF, 0x14, // rst 8: L BREAK into program, as between BEEP statements
+	0xC9, // done: ret
+};
+
+int pb_note(basline *b, int k, int e, unsigned char *note) // if the statement k..e is a constant BEEP the ROM would play, its BEEPER parameters (4 bytes); else 0
+{
+	static const unsigned char semitone[12][5]= // the ROM's SEMI-TONE table (0x046E), middle C up
 	{
-		fprintf(stderr, "bast: Linker (object): Internal error: %s no buffer to write!\n", fname);
-		err=true;
+		{0x89, 0x02, 0xD0, 0x12, 0x86}, {0x89, 0x0A, 0x97, 0x60, 0x75}, {0x89, 0x12, 0xD5, 0x17, 0x1F}, {0x89, 0x1B, 0x90, 0x41, 0x02},
+		{0x89, 0x24, 0xD0, 0x53, 0xCA}, {0x89, 0x2E, 0x9D, 0x36, 0xB1}, {0x89, 0x38, 0xFF, 0x49, 0x3E}, {0x89, 0x43, 0xFF, 0x6A, 0x73},
+		{0x89, 0x4F, 0xA7, 0x00, 0x54}, {0x89, 0x5C, 0x00, 0x00, 0x00}, {0x89, 0x69, 0x14, 0xF6, 0x24}, {0x89, 0x76, 0xF1, 0x10, 0x05},
+	};
+	if((b->tok[k].tok!=0xD7)||(e<k+4)||(b->tok[k+1].tok!=TOKEN_ZXFLOAT)||(b->tok[k+2].tok!=',')) // BEEP
+		return(0);
+	bool neg=(b->tok[k+3].tok=='-');
+	if((e!=k+4+neg)||(b->tok[k+3+neg].tok!=TOKEN_ZXFLOAT))
+		return(0);
+	double t=zxvalue(b->tok[k+1].data2), p=zxvalue(b->tok[k+3+neg].data2)*(neg?-1:1);
+	if((t<=0)||(t>10)||(p!=floor(p))||(p<-60)||(p>127))
+		return(0);
+	int s=p, o=0;
+	while(s<0) { s+=12; o--; }
+	while(s>=12) { s-=12; o++; }
+	char buf[5];
+	double f=ldexp(zxvalue((const char *)semitone[s]), o), de, hl; // the ROM adds the octave to the exponent, which is exact
+	zxfloat(buf, f*t); // each step rounded to a ZX float, as the calculator does
+	de=zxvalue(buf);
+	zxfloat(buf, 437500/f);
+	hl=zxvalue(buf);
+	zxfloat(buf, hl-30.125);
+	hl=zxvalue(buf);
+	de=floor(de+0.5); // FIND-INT2 rounds to the nearest
+	hl=floor(hl+0.5);
+	if((de<2)||(de>65535)||(hl<1)||(hl>65535)) // DE=1 would be 0 after the ROM's DEC DE, which ends the table
+		return(0);
+	unsigned int d=de-1, h=hl; // the ROM does DEC DE before JP BEEPER
+	note[0]=d&0xFF;
+	note[1]=d>>8;
+	note[2]=h&0xFF;
+	note[3]=h>>8;
+	return(4);
+}
+
+int pk_runs(segment *seg, const char *pass, const char *lbl, int (*item)(basline *, int, int, unsigned char *), const unsigned char *end, int elen, const unsigned char *player, int plen, int *nitems, int *nruns, int *nlines) // replace runs of statements item() can pack with 'IF USR @<lbl>+01 THEN REM <items><end>', and add the player at .<lbl>; the bytes saved, or -1 on error
+{
+	bas_seg *bas=&seg->data.bas;
+	int j, k, last=-1;
+	*nitems=*nruns=*nlines=0;
+	if((bas->ovstart>=0)||(bas->ovparent>=0)) // overlays can't reach each other's labels
+		return(0);
+	for(j=0;j<bas->nlines;j++)
+		if(bas->basic[j].ntok)
+			last=j;
+	if(last<0)
+		return(0);
+	bool *target=ml_targets(bas);
+	if(!target)
+	{
+		fprintf(stderr, "bast: %s: not packing %s, as it has a jump bast can't follow\n", pass, seg->name);
+		return(0);
+	}
+	if(!bas->renum&&(bas->basic[last].number>=9999))
+	{
+		fprintf(stderr, "bast: %s: not packing %s, as there's no line number free after its last line\n", pass, seg->name);
+		free(target);
+		return(0);
+	}
+	int apply, gain=0;
+	for(apply=0;apply<2;apply++) // first see whether it pays for the player; then do it
+	{
+		if(apply)
+		{
+			gain-=plen+6; // its line: number, length, REM, player, newline
+			if(gain<=0)
+				break;
+			gain=0;
+		}
+		for(j=0;j<bas->nlines;j++)
+		{
+			basline *b=&bas->basic[j];
+			if(!b->ntok) continue;
+			unsigned char *data=NULL, one[8];
+			int n=0, len=0, s=b->ntok, e, l;
+			for(k=b->ntok-1;k>=0;k--) // the statements at the end of the line which can all be packed: from s
+			{
+				if(k&&(b->tok[k-1].tok!=':')&&(b->tok[k-1].tok!=0xCB)) continue;
+				if((pd_end(b, k)!=((s<b->ntok)?s-1:s))||!item(b, k, pd_end(b, k), one)) break;
+				s=k;
+			}
+			if(s==b->ntok)
+				continue;
+			bool cond=false;
+			for(k=0;k<s;k++)
+				cond|=(b->tok[k].tok==0xCB);
+			for(k=s;k<b->ntok;k=e+1) // this line's items, in order
+			{
+				e=pd_end(b, k);
+				data=(unsigned char *)realloc(data, len+8);
+				len+=item(b, k, e, data+len);
+				n++;
+			}
+			int saved=0, stop=j;
+			for(l=j+1;!cond&&(l<bas->nlines);l++) // and on through lines which can be packed whole, that nothing jumps into
+			{
+				basline *c=&bas->basic[l];
+				if(!c->ntok)
+				{
+					if(*c->text=='.') break;
+					continue;
+				}
+				if(target[l]) break;
+				int m=n, mlen=len;
+				for(k=0;k<c->ntok;k=e+1)
+				{
+					e=pd_end(c, k);
+					data=(unsigned char *)realloc(data, len+8);
+					int il=item(c, k, e, data+len);
+					if(!il) break;
+					len+=il;
+					n++;
+				}
+				if(k<c->ntok)
+				{
+					n=m;
+					len=mlen;
+					break;
+				}
+				saved+=ml_size(c)+5;
+				stop=l;
+			}
+			data=(unsigned char *)realloc(data, len+elen);
+			memcpy(data+len, end, elen);
+			len+=elen;
+			token *nt=(token *)malloc((s+5)*sizeof(token));
+			memcpy(nt, b->tok, s*sizeof(token));
+			int nn=s;
+			nt[nn++]=mktok(0xFA); // IF, not RANDOMIZE, which would set SEED from FRAMES if USR gave 0; either way the REM is skipped
+			nt[nn++]=mktok(0xC0); // USR
+			nt[nn]=mktok(TOKEN_PTRLBL);
+			nt[nn].data=strdup(lbl);
+			nt[nn++].index=1;
+			nt[nn++]=mktok(0xCB); // THEN
+			nt[nn]=mktok(0xEA);
+			nt[nn].data=(char *)data;
+			nt[nn++].dl=len;
+			basline nb={.ntok=nn, .tok=nt};
+			saved+=ml_size(b)-ml_size(&nb);
+			if((saved<=0)||!apply)
+			{
+				if(saved>0)
+					gain+=saved;
+				free(nt);
+				free(data);
+				j=(saved>0)?stop:j;
+				continue;
+			}
+			for(l=j+1;l<=stop;l++)
+			{
+				basline *c=&bas->basic[l];
+				if(!c->ntok) continue;
+				free(c->tok);
+				c->tok=NULL;
+				c->ntok=0;
+				bas->blines--;
+				(*nlines)++;
+			}
+			free(b->tok);
+			b->tok=nt;
+			b->ntok=nn;
+			gain+=saved;
+			(*nruns)++;
+			*nitems+=n;
+			j=stop;
+		}
+	}
+	free(target);
+	if(!*nruns)
+		return(0);
+	char line[64];
+	sprintf(line, ".%s", lbl); // the player goes at the end, out of the way of line searches
+	if(addbasline(&bas->nlines, &bas->basic, line))
+	{
+		fprintf(stderr, "bast: Internal error: %s: failed to add line\n", pass);
+		return(-1);
+	}
+	basline *b=&bas->basic[bas->nlines-1];
+	b->sline=bas->basic[last].sline;
+	if(addbasline(&bas->nlines, &bas->basic, "REM"))
+	{
+		fprintf(stderr, "bast: Internal error: %s: failed to add line\n", pass);
+		return(-1);
+	}
+	b=&bas->basic[bas->nlines-1];
+	b->sline=bas->basic[last].sline;
+	b->number=bas->renum?0:bas->basic[last].number+1;
+	b->tok=(token *)malloc(sizeof(token));
+	b->tok[0]=mktok(0xEA);
+	b->tok[0].data=(char *)malloc(plen);
+	memcpy(b->tok[0].data, player, plen);
+	b->tok[0].dl=plen;
+	b->ntok=1;
+	bas->blines++;
+	return(gain-(plen+6));
+}
+
+int opt_packbeeps(int *nsegs, segment **data, __attribute__((unused)) char **inbas) // turn runs of constant BEEPs into a table for a machine-code player
+{
+	static const unsigned char end[2]={0, 0};
+	int i;
+	for(i=0;i<*nsegs;i++)
+	{
+		if((*data)[i].type!=BASIC) continue;
+		char lbl[32];
+		sprintf(lbl, "beeps%u", i);
+		int nnotes, nruns, nlines, gain=pk_runs(&(*data)[i], "pack-beeps", lbl, pb_note, end, sizeof(end), pb_player, sizeof(pb_player), &nnotes, &nruns, &nlines);
+		if(gain<0)
+			return(1);
+		if(nruns)
+			fprintf(stderr, "bast: pack-beeps: %s: packed %u notes in %u runs (%u lines removed), saving %d bytes; they now play back to back, without the interpreter between them\n", (*data)[i].name, nnotes, nruns, nlines, gain);
+	}
+	return(0);
+}
+
+const unsigned char pv_player[79]= // the player -O pack-draw puts at '.draw<n>', for IF USR ... THEN REM: replays the PLOTs and DRAWs in the REM after the call
+{
+	0xCD, 0x4D, 0x0D, // call TEMPS, as PLOT and DRAW do
+	0x2A, 0x5D, 0x5C, // ld hl,(CH_ADD)
+	0x7E, 0x23, 0xFE, 0xEA, 0x20, 0xFA, // find: ld a,(hl); inc hl; cp REM; jr nz,find
+	0x7E, 0x23, 0x4E, 0x23, 0xFE, 0x82, 0x28, 0x3A, // next: ld a,(hl); inc hl; ld c,(hl); inc hl; cp 0x82; jr z,done
+	0xFE, 0x80, 0x20, 0x09, // cp 0x80; jr nz,notplot
+	0x46, 0x23, 0xE5, 0xCD, 0xE5, 0x22, 0xE1, 0x18, 0xEB, // ld b,(hl); inc hl; push hl; call PLOT-SUB; pop hl; jr next
+	0xFE, 0x81, 0x20, 0x08, // notplot: cp 0x81; jr nz,short
+	0x46, 0x23, 0x5E, 0x23, 0x56, 0x23, 0x18, 0x1A, // ld b,(hl); inc hl; ld e,(hl); inc hl; ld d,(hl); inc hl; jr line
+	0x1E, 0x01, 0xCB, 0x7F, 0x28, 0x04, 0x1E, 0xFF, 0xED, 0x44, // short: ld e,1; bit 7,a; jr z,px; ld e,-1; neg
+	0x16, 0x01, 0xCB, 0x79, 0x28, 0x08, 0x16, 0xFF, 0x47, 0x79, 0xED, 0x44, 0x4F, 0x78, // px: ld d,1; bit 7,c; jr z,py; ld d,-1; ld b,a; ld a,c; neg; ld c,a; ld a,b
+	0x41, 0x4F, // py: ld b,c; ld c,a
+	0xE5, 0xCD, 0xBA, 0x24, 0xE1, 0x18, 0xBE, // line: push hl; call DRAW-LINE; pop hl; jr next
+	0xC9, // done: ret
+};
+
+bool pv_arg(basline *b, int *k, int e, int *value) // a whole-number constant at *k (with a '-'), stepping past it
+{
+	bool neg=(*k<e)&&(b->tok[*k].tok=='-');
+	*k+=neg;
+	if((*k>=e)||(b->tok[*k].tok!=TOKEN_ZXFLOAT))
+		return(false);
+	double v=zxvalue(b->tok[(*k)++].data2);
+	if((v!=floor(v))||(v>255))
+		return(false);
+	*value=neg?-v:v;
+	return(true);
+}
+
+int pv_item(basline *b, int k, int e, unsigned char *out) // if the statement k..e is a constant PLOT x,y or DRAW x,y, its bytes for the player; else 0
+{
+	unsigned char tok=b->tok[k++].tok;
+	int x, y;
+	if(((tok!=0xF6)&&(tok!=0xFC))||!pv_arg(b, &k, e, &x)||(k>=e)||(b->tok[k++].tok!=',')||!pv_arg(b, &k, e, &y)||(k!=e)) // PLOT, DRAW
+		return(0);
+	if(tok==0xF6)
+	{
+		if((x<0)||(y<0)) // the ROM would plot at ABS, but bast won't rely on it
+			return(0);
+		out[0]=0x80;
+		out[1]=x;
+		out[2]=y;
+		return(3);
+	}
+	if((x>=-125)&&(x<=127)&&(y>=-128)&&(y<=127)) // a short DRAW: dx (not 0x80-0x82, which mark the others), dy
+	{
+		out[0]=x;
+		out[1]=y;
+		return(2);
+	}
+	out[0]=0x81;
+	out[1]=abs(x);
+	out[2]=abs(y);
+	out[3]=(x<0)?0xFF:1;
+	out[4]=(y<0)?0xFF:1;
+	return(5);
+}
+
+int opt_packdraw(int *nsegs, segment **data, __attribute__((unused)) char **inbas) // turn runs of constant PLOTs and DRAWs into a table for a machine-code player
+{
+	static const unsigned char end[1]={0x82};
+	int i;
+	for(i=0;i<*nsegs;i++)
+	{
+		if((*data)[i].type!=BASIC) continue;
+		char lbl[32];
+		sprintf(lbl, "draw%u", i);
+		int nitems, nruns, nlines, gain=pk_runs(&(*data)[i], "pack-draw", lbl, pv_item, end, sizeof(end), pv_player, sizeof(pv_player), &nitems, &nruns, &nlines);
+		if(gain<0)
+			return(1);
+		if(nruns)
+			fprintf(stderr, "bast: pack-draw: %s: packed %u PLOTs and DRAWs in %u runs (%u lines removed), saving %d bytes; the ROM no longer reads their numbers as it draws\n", (*data)[i].name, nitems, nruns, nlines, gain);
 	}
+	return(0);
 }
@@ -0,0 +1,216 @@
+/*
+	bast - ZX Basic text to tape
+
+	Copyright Edward Cree, 2010
+	License: GNU GPL v3+
+
+	dskls: list the files on a +3 disk image (as written by bast -d), checking its layout as it goes
+*/
+
+#define _GNU_SOURCE	// feature test macro
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAXTRACKS	84
+#define MAXSECTORS	29
+
+unsigned char *sector[MAXTRACKS][MAXSECTORS]; // by track and sector ID (R, from 1)
+int ntracks=0, nsectors=0, reserved=0, nblocks=0;
+
+unsigned char *block(int b) // a 1k block of the data area, which starts after the reserved tracks; NULL if it isn't on the disk
+{
+	static unsigned char buf[1024];
+	int h;
+	if((b<0)||(b>=nblocks))
+		return(NULL);
+	for(h=0;h<2;h++) // a block can straddle two tracks
+	{
+		int rec=(reserved*nsectors)+(b*2)+h; // 512-byte sectors from the start of the disk
+		int t=rec/nsectors, s=rec%nsectors+1;
+		if((t>=ntracks)||!sector[t][s])
+			return(NULL);
+		memcpy(buf+h*512, sector[t][s], 512);
+	}
+	return(buf);
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc!=2)
+	{
+		fprintf(stderr, "usage: dskls <image.dsk>\n");
+		return(EXIT_FAILURE);
+	}
+	FILE *fp=fopen(argv[1], "rb");
+	if(!fp)
+	{
+		fprintf(stderr, "dskls: could not open %s\n", argv[1]);
+		return(EXIT_FAILURE);
+	}
+	unsigned char di[256];
+	if((fread(di, 1, 256, fp)!=256)||memcmp(di, "EXTENDED CPC DSK File\r\nDisk-Info\r\n", 34))
+	{
+		fprintf(stderr, "dskls: %s is not an extended DSK image\n", argv[1]);
+		return(EXIT_FAILURE);
+	}
+	ntracks=di[48];
+	if((ntracks>MAXTRACKS)||(di[49]!=1))
+	{
+		fprintf(stderr, "dskls: %u tracks, %u sides: not a +3 disk\n", ntracks, di[49]);
+		return(EXIT_FAILURE);
+	}
+	int t;
+	for(t=0;t<ntracks;t++)
+	{
+		int tlen=di[52+t]<<8;
+		unsigned char *trk=(unsigned char *)malloc(tlen);
+		if(!tlen||(fread(trk, 1, tlen, fp)!=(size_t)tlen)||memcmp(trk, "Track-Info\r\n", 12)||(trk[16]!=t))
+		{
+			fprintf(stderr, "dskls: bad or missing Track-Info for track %u\n", t);
+			return(EXIT_FAILURE);
+		}
+		int ns=trk[21], s, off=256;
+		if(ns>=MAXSECTORS)
+		{
+			fprintf(stderr, "dskls: track %u has %u sectors\n", t, ns);
+			return(EXIT_FAILURE);
+		}
+		for(s=0;s<ns;s++)
+		{
+			unsigned char *si=trk+24+8*s;
+			int len=si[6]|(si[7]<<8), r=si[2];
+			if((si[0]!=t)||(len!=512)||(r<1)||(r>=MAXSECTORS)||(off+len>tlen))
+			{
+				fprintf(stderr, "dskls: track %u: bad sector %u (C=%u R=%u, %u bytes)\n", t, s, si[0], r, len);
+				return(EXIT_FAILURE);
+			}
+			sector[t][r]=trk+off;
+			off+=len;
+		}
+		if(!t)
+			nsectors=ns;
+		else if(ns!=nsectors)
+		{
+			fprintf(stderr, "dskls: track %u has %u sectors, track 0 %u\n", t, ns, nsectors);
+			return(EXIT_FAILURE);
+		}
+	}
+	fclose(fp);
+	unsigned char *boot=sector[0][1];
+	if(!boot||(boot[0]!=0)||(boot[2]!=ntracks)||(boot[3]!=nsectors)||(boot[4]!=2)||(boot[6]!=3))
+	{
+		fprintf(stderr, "dskls: boot sector disk specification doesn't match the image\n");
+		return(EXIT_FAILURE);
+	}
+	reserved=boot[5];
+	nblocks=(ntracks-reserved)*nsectors/2;
+	int dirblocks=boot[7], ndir=dirblocks*1024/32;
+	unsigned char *dir=(unsigned char *)malloc(dirblocks*1024);
+	int b;
+	for(b=0;b<dirblocks;b++)
+	{
+		unsigned char *p=block(b);
+		if(!p)
+		{
+			fprintf(stderr, "dskls: directory block %u is missing\n", b);
+			return(EXIT_FAILURE);
+		}
+		memcpy(dir+b*1024, p, 1024);
+	}
+	char *used=(char *)calloc(nblocks, 1);
+	int e, nfiles=0, errs=0;
+	for(e=0;e<ndir;e++)
+	{
+		unsigned char *d=dir+32*e;
+		if(d[0]==0xE5) continue;
+		if(d[12]||d[14]) continue; // later extents are read with the first
+		// the file's extents, in order
+		int nrec=0, ext, f, i;
+		unsigned char *data=NULL;
+		for(ext=0;;ext++)
+		{
+			for(f=0;f<ndir;f++)
+			{
+				unsigned char *x=dir+32*f;
+				if((x[0]==d[0])&&!memcmp(x+1, d+1, 11)&&(x[12]==(ext&0x1F))&&(x[14]==(ext>>5)))
+					break;
+			}
+			if(f==ndir) break;
+			unsigned char *x=dir+32*f;
+			if(ext&&(nrec!=ext*128))
+			{
+				fprintf(stderr, "dskls: %.11s: extent %u follows a short one\n", d+1, ext);
+				errs++;
+			}
+			nrec+=x[15];
+			data=(unsigned char *)realloc(data, nrec*128+1024);
+			for(i=0;(i<16)&&(i*8<x[15]);i++)
+			{
+				unsigned char *p=(x[16+i]<dirblocks)?NULL:block(x[16+i]);
+				if(!p)
+				{
+					fprintf(stderr, "dskls: %.11s: block %u is outside the data area\n", d+1, x[16+i]);
+					return(EXIT_FAILURE);
+				}
+				if(used[x[16+i]]++)
+				{
+					fprintf(stderr, "dskls: %.11s: block %u is used twice\n", d+1, x[16+i]);
+					errs++;
+				}
+				memcpy(data+(ext*16+i)*1024, p, 1024);
+			}
+		}
+		nfiles++;
+		unsigned char sum=0;
+		for(i=0;i<127;i++)
+			sum+=data[i];
+		if((nrec<1)||memcmp(data, "PLUS3DOS\x1A", 9)||(sum!=data[127]))
+		{
+			fprintf(stderr, "dskls: %.11s: no valid PLUS3DOS header\n", d+1);
+			errs++;
+			free(data);
+			continue;
+		}
+		long flen=data[11]|(data[12]<<8)|(data[13]<<16)|((long)data[14]<<24);
+		int len=data[16]|(data[17]<<8), p1=data[18]|(data[19]<<8), p2=data[20]|(data[21]<<8);
+		if((flen!=len+128)||((flen+127)/128!=nrec))
+		{
+			fprintf(stderr, "dskls: %.11s: header says %ld bytes (%u of data), directory %u records\n", d+1, flen, len, nrec);
+			errs++;
+		}
+		char name[13];
+		int n=0;
+		for(i=1;(i<9)&&(d[i]!=' ');i++)
+			name[n++]=d[i]&0x7F;
+		if(d[9]!=' ')
+			name[n++]='.';
+		for(i=9;(i<12)&&(d[i]!=' ');i++)
+			name[n++]=d[i]&0x7F; // top bits are the read-only, system and archive attributes
+		name[n]=0;
+		printf("%s", name);
+		switch(data[15])
+		{
+			case 0:
+				printf("\tPROGRAM\t%u bytes", len);
+				if(p1<0x8000)
+					printf(", LINE %u", p1);
+				printf(", variables at %u\n", p2);
+			break;
+			case 3:
+				printf("\tCODE\t%u,%u\n", p1, len);
+			break;
+			default:
+				printf("\ttype %u\t%u bytes\n", data[15], len);
+			break;
+		}
+		free(data);
+	}
+	if(!nfiles)
+	{
+		fprintf(stderr, "dskls: no files\n");
+		errs++;
+	}
+	return(errs?EXIT_FAILURE:EXIT_SUCCESS);
+}
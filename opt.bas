@@ -0,0 +1,3 @@
+#pragma name opt
+10 REM Cases the optimiser passes have got wrong; 'make check' builds this and looks for the right output
+20 PRINT SIN (1-3)^2: REM (SIN -2)^2, so constant-arithmetic must keep the brackets
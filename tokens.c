@@ -9,6 +9,9 @@
 
 #include "tokens.h"
 
+int ntokens;
+token * tokentable;
+
 void mktoktbl(void)
 {
 	ntokens=0;
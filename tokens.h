@@ -17,8 +17,9 @@
 #define TOKEN_LABEL		0x14
 #define TOKEN_PTRLBL	0x15
 #define TOKEN_RLINK		0x18
+#define TOKEN_LOADER	0x1A
 
-int ntokens;
+extern int ntokens;
 typedef struct
 {
 	char *text;
@@ -31,7 +32,7 @@ typedef struct
 }
 token;
 
-token * tokentable;
+extern token * tokentable;
 
 void mktoktbl(void);
 void addtokd(char *text, unsigned char tok);
@@ -0,0 +1,13 @@
+/*
+	bast - ZX Basic text to tape
+	
+	Copyright Edward Cree, 2010
+	License: GNU GPL v3+
+	version.h: contains version number (generated from git describe)
+*/
+#pragma once
+#define VERSION_MAJ 0 // Major version
+#define VERSION_MIN 0 // Minor version
+#define VERSION_REV 0 // Revision number
+#define VERSION_TXT "" // Rest of git describe
+#define CC_VERSION	"gcc version 12.2.0 (Debian 12.2.0-14+deb12u1) " // last line of cc -v